@@ -0,0 +1,548 @@
+// Throughput benchmarks. Built as its own console program, like test/, with the
+// core sources included directly so the micro benchmarks can reach their internals.
+// perf_counters.c is compiled separately, its system headers clash with read/write.
+//
+// Usage: bench [--frames n] [--out file.json] [--perf run|frame] [rom.gb[:movie.amov]]...
+//
+// Runs the built-in workloads (and any ROM/movie given) headless for n frames, then the
+// micro benchmarks, and writes the results as JSON (bench.json by default).
+// --perf adds hardware counters (Linux), bracketing the whole run or every frame.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+// Allocation hooks, the core sources below allocate through these
+size_t  bench_allocs;
+size_t  bench_frees;
+size_t  bench_alloc_bytes;
+
+void* bench_malloc(size_t size)             { bench_allocs++; bench_alloc_bytes += size; return malloc(size); }
+void* bench_calloc(size_t count, size_t size) { bench_allocs++; bench_alloc_bytes += count * size; return calloc(count, size); }
+void* bench_realloc(void* p, size_t size)   { bench_allocs++; bench_alloc_bytes += size; return realloc(p, size); }
+void  bench_free(void* p)                   { if (p) bench_frees++; free(p); }
+
+#define malloc(size)        bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(p, size)    bench_realloc(p, size)
+#define free(p)             bench_free(p)
+
+#include "../src/cpu.c"
+#include "../src/ppu.c"
+#include "../src/apu.c"
+#include "../src/blip.c"
+#include "../src/timer.c"
+#include "../src/trace.c"
+#include "../src/profiler.c"
+#include "../src/spsc_queue.c"
+#include "../src/timeline.c"
+#include "../src/movie.c"
+#include "../src/graphics.c"
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+#include "perf_counters.h"
+
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"    // pass -DBENCH_REVISION=\"<commit>\" to tag the results
+#endif
+
+#define BENCH_ROM_SIZE      0x8000
+#define MAX_WORKLOADS       16
+#define MAX_MICRO           8
+#define MICRO_ITERATIONS    2000000
+#define BENCH_SCHEMA        2       // bump when fields change meaning
+
+typedef enum PerfMode {
+    PERF_OFF,
+    PERF_RUN,       // one reading around the whole run
+    PERF_FRAME      // a reading around every frame, also finds the worst one
+} PerfMode;
+
+typedef struct Workload {
+    const char* name;
+    const char* rom_path;   // NULL for built-in
+    const char* movie_path; // NULL for none
+    u8          builtin;    // index in builtin_programs
+} Workload;
+
+typedef struct WorkloadResult {
+    const char* name;
+    u32     frames;
+    double  seconds;
+    u64     instructions;
+    size_t  init_allocs;    // during power up
+    size_t  allocs;         // while running
+    size_t  alloc_bytes;
+    PerfSample perf;            // whole run
+    u64     worst_frame_cycles; // PERF_FRAME only
+} WorkloadResult;
+
+typedef struct MicroResult {
+    const char* name;
+    u64     iterations;
+    double  ns_per_op;
+    u8      skipped;
+    PerfSample perf;
+} MicroResult;
+
+// Built-in programs, placed at 0x150. Interrupt handlers go at their vectors.
+typedef struct BuiltinProgram {
+    const char* name;
+    const u8*   code;
+    u32         size;
+    const u8*   timer_handler;
+    u32         timer_handler_size;
+} BuiltinProgram;
+
+// ALU work and WRAM writes
+const u8 prog_cpu_loop[] = {
+    0x21, 0x00, 0xC0,   // LD HL,C000
+    0x06, 0x00,         // LD B,0
+    0x3C,               // INC A
+    0x80,               // ADD A,B
+    0x77,               // LD (HL),A
+    0x2C,               // INC L
+    0xCB, 0x37,         // SWAP A
+    0x05,               // DEC B
+    0x20, 0xF7,         // JR NZ,-9
+    0x18, 0xF0          // JR -16
+};
+// 40 sprites over a filled tile set, then idles
+const u8 prog_sprites[] = {
+    0x21, 0x00, 0x80,   // LD HL,8000
+    0x7D,               // LD A,L       fill 8000-8FFF
+    0x22,               // LD (HL+),A
+    0x7C,               // LD A,H
+    0xFE, 0x90,         // CP 90
+    0x20, 0xF9,         // JR NZ,-7
+    0x21, 0x00, 0xFE,   // LD HL,FE00
+    0x06, 0x00,         // LD B,0
+    0x78, 0x87, 0xC6, 0x10, 0x22,       // Y = 16 + 2i
+    0x78, 0x87, 0x87, 0xC6, 0x08, 0x22, // X = 8 + 4i
+    0x78, 0x22,                         // tile = i
+    0x78, 0xE6, 0x30, 0x22,             // attributes = i & 30
+    0x04,               // INC B
+    0x78,               // LD A,B
+    0xFE, 0x28,         // CP 40
+    0x20, 0xE9,         // JR NZ,-23
+    0x3E, 0x93,         // LD A,93      LCD, OBJ and BG on, tiles at 8000
+    0xE0, 0x40,         // LDH (40),A
+    0x18, 0xFE          // JR -2
+};
+// Timer interrupts every 256 dots, HALT in between
+const u8 prog_timer_irq[] = {
+    0x3E, 0x04, 0xE0, 0xFF, // IE = timer
+    0x3E, 0xF0, 0xE0, 0x06, // TMA = F0
+    0x3E, 0x05, 0xE0, 0x07, // TAC = enabled, 16 dots
+    0xFB,               // EI
+    0x76,               // HALT
+    0x18, 0xFD          // JR -3
+};
+const u8 handler_timer_irq[] = {
+    0x0C,               // INC C
+    0xD9                // RETI
+};
+
+const BuiltinProgram builtin_programs[] = {
+    { "cpu_loop",   prog_cpu_loop,  sizeof(prog_cpu_loop),  NULL, 0 },
+    { "sprites",    prog_sprites,   sizeof(prog_sprites),   NULL, 0 },
+    { "timer_irq",  prog_timer_irq, sizeof(prog_timer_irq), handler_timer_irq, sizeof(handler_timer_irq) },
+};
+#define BUILTIN_COUNT (sizeof(builtin_programs) / sizeof(builtin_programs[0]))
+
+u32             frames = 600;
+PerfMode        perf_mode = PERF_OFF;
+PerfSample      micro_perf_start;
+volatile u32    sink;   // keeps results of the micro benchmarks alive
+
+// Helpers ------------------------------------------------------------
+
+double seconds_since(Uint64 start)
+{
+    return (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+u8* build_rom(const BuiltinProgram* program, long* size)
+{
+    u8* rom = (u8*)calloc(BENCH_ROM_SIZE, 1);
+    if (rom == NULL) return NULL;
+
+    rom[0x100] = 0xC3; // JP 0150
+    rom[0x101] = 0x50;
+    rom[0x102] = 0x01;
+    memcpy(rom + 0x150, program->code, program->size);
+    if (program->timer_handler) memcpy(rom + INT_VEC_TIMER, program->timer_handler, program->timer_handler_size);
+    *size = BENCH_ROM_SIZE;
+    return rom;
+}
+
+u8* load_file(const char* path, long* size)
+{
+    FILE*   fp = fopen(path, "rb");
+    u8*     buffer;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        return NULL;
+    }
+    fseek(fp, 0L, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0L, SEEK_SET);
+    buffer = (u8*)malloc(*size);
+    if (buffer == NULL || fread(buffer, 1, *size, fp) != (size_t)*size) {
+        fprintf(stderr, "Failed to read file: %s\n", path);
+        if (buffer) free(buffer);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    return buffer;
+}
+
+// Powers up the core on a ROM the way headless mode does (no synthesis)
+int power_on(u8* rom, long size, const char* movie_path)
+{
+    if (apu_init(APU_SAMPLE_RATE) == -1) return -1;
+    if (cpu_init(rom) == -1) return -1;
+    if (ppu_init() == -1) return -1;
+    apu_set_synthesis(0, cpu_get_cycles());
+    if (movie_path && movie_play_start(movie_path, rom, (u32)size) == -1) return -1;
+    return 0;
+}
+
+void power_off()
+{
+    movie_stop();
+    ppu_cleanup();
+    cpu_cleanup();
+    apu_cleanup();
+}
+
+// Workloads ----------------------------------------------------------
+
+int run_workload(const Workload* w, WorkloadResult* r)
+{
+    u8*     rom;
+    long    size;
+    u8      buttons;
+    u64     instructions;
+    size_t  allocs, bytes;
+    Uint64  start;
+    PerfSample perf_start, perf_end, perf_frame;
+
+    memset(r, 0, sizeof(*r));
+    r->name = w->name;
+    allocs = bench_allocs;
+    rom = w->rom_path ? load_file(w->rom_path, &size) : build_rom(&builtin_programs[w->builtin], &size);
+    if (rom == NULL || power_on(rom, size, w->movie_path) == -1) return -1;
+    r->init_allocs = bench_allocs - allocs;
+
+    allocs = bench_allocs;
+    bytes = bench_alloc_bytes;
+    instructions = cpu_get_instructions();
+    start = SDL_GetPerformanceCounter();
+    perf_read(&perf_start);
+
+    for (r->frames = 0; w->movie_path ? movie_playing() : r->frames < frames; r->frames++) {
+        if (w->movie_path) {
+            movie_next_frame(&buttons);
+            cpu_set_buttons(buttons);
+        }
+        if (perf_mode == PERF_FRAME) perf_read(&perf_frame);
+        gb_run_until_vblank();
+        apu_end_frame(cpu_get_cycles());
+        if (perf_mode == PERF_FRAME) {
+            perf_read(&perf_end);
+            perf_diff(&perf_frame, &perf_end, &perf_frame);
+            perf_add(&r->perf, &perf_frame);
+            if (perf_frame.value[PERF_CYCLES] > r->worst_frame_cycles) r->worst_frame_cycles = perf_frame.value[PERF_CYCLES];
+        }
+    }
+
+    r->seconds = seconds_since(start);
+    if (perf_mode == PERF_RUN) {
+        perf_read(&perf_end);
+        perf_diff(&perf_start, &perf_end, &r->perf);
+    }
+    r->instructions = cpu_get_instructions() - instructions;
+    r->allocs = bench_allocs - allocs;
+    r->alloc_bytes = bench_alloc_bytes - bytes;
+    power_off();
+    return 0;
+}
+
+// Micro benchmarks ---------------------------------------------------
+
+// Start of a timed section, also takes the counters
+Uint64 micro_start()
+{
+    perf_read(&micro_perf_start);
+    return SDL_GetPerformanceCounter();
+}
+
+void micro_result(MicroResult* m, const char* name, u64 iterations, Uint64 start)
+{
+    PerfSample perf_end;
+
+    m->name = name;
+    m->iterations = iterations;
+    m->ns_per_op = seconds_since(start) * 1e9 / iterations;
+    m->skipped = 0;
+    perf_read(&perf_end);
+    perf_diff(&micro_perf_start, &perf_end, &m->perf);
+}
+
+// Fetch, tick and execute over an instruction mix in WRAM
+void micro_execute_instruction(MicroResult* m)
+{
+    const u8 mix[] = { 0x3C, 0x80, 0x77, 0x2C, 0xCB, 0x37, 0x00, 0x1A, 0x13, 0xA8 };
+    u16 addr = 0xC000;
+    Uint64 start;
+
+    for (u32 i = 0; i < 100; i++) {
+        for (u32 j = 0; j < sizeof(mix); j++) wram[(addr++) & 0xFFF] = mix[j];
+    }
+    wram[(addr++) & 0xFFF] = 0xC3; // JP C000
+    wram[(addr++) & 0xFFF] = 0x00;
+    wram[(addr++) & 0xFFF] = 0xC0;
+
+    PC = 0xC000;
+    HL.full = 0xD000;
+    DE.full = 0xC800;
+    interrupts_enabled = 0;
+    start = micro_start();
+    for (u32 i = 0; i < MICRO_ITERATIONS; i++) {
+        u8 op = read(PC++);
+        tick();
+        execute_instruction(op);
+    }
+    micro_result(m, "execute_instruction", MICRO_ITERATIONS, start);
+}
+
+// Reads across ROM, VRAM, WRAM, OAM, IO and HRAM
+void micro_read(MicroResult* m)
+{
+    const u16 bases[] = { 0x0150, 0x4000, 0x8000, 0xC000, 0xD000, 0xFE00, 0xFF40, 0xFF80 };
+    u32 sum = 0;
+    Uint64 start = micro_start();
+
+    for (u32 i = 0; i < MICRO_ITERATIONS; i++) {
+        sum += read(bases[i & 7] + ((i >> 3) & 0x1F));
+    }
+    sink = sum;
+    micro_result(m, "read", MICRO_ITERATIONS, start);
+}
+
+// WRAM and HRAM writes, each also ticks the rest of the machine by one M-cycle
+void micro_write(MicroResult* m)
+{
+    Uint64 start = micro_start();
+
+    for (u32 i = 0; i < MICRO_ITERATIONS; i++) {
+        write((i & 1) ? 0xC000 + (i & 0xFFF) : 0xFF80 + (i & 0x3F), (u8)i);
+    }
+    micro_result(m, "write", MICRO_ITERATIONS, start);
+}
+
+// Whole scanlines, over the sprites workload's screen
+void micro_draw(MicroResult* tiles, MicroResult* sprites)
+{
+    u32     lines = MICRO_ITERATIONS / 10;
+    Uint64  start;
+
+    update_line_lut();
+    start = micro_start();
+    for (u32 i = 0; i < lines; i++) draw_tiles(i % SCREEN_HEIGHT);
+    micro_result(tiles, "draw_tiles", lines, start);
+
+    start = micro_start();
+    for (u32 i = 0; i < lines; i++) draw_sprites(i % SCREEN_HEIGHT);
+    micro_result(sprites, "draw_sprites", lines, start);
+}
+
+// Texture uploads, needs an OpenGL context
+void micro_upload(MicroResult* m)
+{
+    u32         uploads = 2000;
+    SDL_Window* window;
+    Uint64      start;
+
+    m->name = "graphics_update_rgba_buffer";
+    m->iterations = 0;
+    m->ns_per_op = 0.0;
+    m->skipped = 1;
+
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0) return;
+    window = SDL_CreateWindow("bench", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+        SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+    if (window == NULL || !graphics_init(window)) {
+        if (window) SDL_DestroyWindow(window);
+        SDL_QuitSubSystem(SDL_INIT_VIDEO);
+        return;
+    }
+
+    ppu_set_output_format(graphics_get_pixel_format(), graphics_get_palette());
+    start = micro_start();
+    for (u32 i = 0; i < uploads; i++) {
+        ppu_get_pixel_buffer()[i % ppu_get_pixel_buffer_size()] ^= 1;
+        graphics_update_rgba_buffer(ppu_get_pixel_buffer());
+    }
+    glFinish();
+    micro_result(m, "graphics_update_rgba_buffer", uploads, start);
+
+    graphics_cleanup();
+    SDL_DestroyWindow(window);
+    SDL_QuitSubSystem(SDL_INIT_VIDEO);
+}
+
+int run_micro(MicroResult* results)
+{
+    u8*     rom;
+    long    size;
+    u32     count = 0;
+
+    // Core micro benchmarks run on the sprites workload after it set up the screen
+    rom = build_rom(&builtin_programs[1], &size);
+    if (rom == NULL || power_on(rom, size, NULL) == -1) return 0;
+    for (u32 i = 0; i < 3; i++) gb_run_until_vblank();
+
+    micro_draw(&results[count], &results[count + 1]);
+    count += 2;
+    micro_upload(&results[count++]);
+    micro_read(&results[count++]);
+    micro_write(&results[count++]);
+    micro_execute_instruction(&results[count++]);
+
+    power_off();
+    return count;
+}
+
+// Output -------------------------------------------------------------
+
+// Counters divided by the amount of frames or operations, "perf": null when unavailable
+void write_perf_json(FILE* fp, const PerfSample* p, u64 divisor, const char* per)
+{
+    if (!p->valid[PERF_CYCLES] || divisor == 0) {
+        fprintf(fp, "\"perf\": null");
+        return;
+    }
+    fprintf(fp, "\"perf\": { ");
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+        if (p->valid[i]) fprintf(fp, "\"%s_per_%s\": %.2f, ", perf_counter_name(i), per, (double)p->value[i] / divisor);
+    }
+    fprintf(fp, "\"ipc\": %.3f", p->valid[PERF_INSTRUCTIONS] && p->value[PERF_CYCLES]
+        ? (double)p->value[PERF_INSTRUCTIONS] / p->value[PERF_CYCLES] : 0.0);
+    if (p->valid[PERF_BRANCHES] && p->valid[PERF_BRANCH_MISSES] && p->value[PERF_BRANCHES]) {
+        fprintf(fp, ", \"branch_miss_rate\": %.5f", (double)p->value[PERF_BRANCH_MISSES] / p->value[PERF_BRANCHES]);
+    }
+    fprintf(fp, " }");
+}
+
+void write_json(FILE* fp, const WorkloadResult* w, int workload_count, const MicroResult* m, int micro_count)
+{
+    fprintf(fp, "{\n  \"schema\": %d,\n  \"revision\": \"%s\",\n  \"frames\": %u,\n  \"perf_mode\": \"%s\",\n  \"workloads\": [\n",
+        BENCH_SCHEMA, BENCH_REVISION, frames, perf_mode == PERF_RUN ? "run" : perf_mode == PERF_FRAME ? "frame" : "off");
+    for (int i = 0; i < workload_count; i++) {
+        double seconds = w[i].seconds > 0.0 ? w[i].seconds : 1e-9;
+        fprintf(fp, "    { \"name\": \"%s\", \"frames\": %u, \"seconds\": %.6f, \"fps\": %.2f, "
+            "\"instructions\": %llu, \"instructions_per_sec\": %.0f, \"ns_per_frame\": %.1f, "
+            "\"init_allocs\": %zu, \"allocs\": %zu, \"alloc_bytes\": %zu, ",
+            w[i].name, w[i].frames, w[i].seconds, w[i].frames / seconds,
+            w[i].instructions, w[i].instructions / seconds, w[i].frames ? seconds * 1e9 / w[i].frames : 0.0,
+            w[i].init_allocs, w[i].allocs, w[i].alloc_bytes);
+        if (perf_mode == PERF_FRAME && w[i].perf.valid[PERF_CYCLES]) {
+            fprintf(fp, "\"worst_frame_cycles\": %llu, ", w[i].worst_frame_cycles);
+        }
+        write_perf_json(fp, &w[i].perf, w[i].frames, "frame");
+        fprintf(fp, " }%s\n", i + 1 < workload_count ? "," : "");
+    }
+    fprintf(fp, "  ],\n  \"micro\": [\n");
+    for (int i = 0; i < micro_count; i++) {
+        fprintf(fp, "    { \"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.2f, \"skipped\": %s, ",
+            m[i].name, m[i].iterations, m[i].ns_per_op, m[i].skipped ? "true" : "false");
+        write_perf_json(fp, &m[i].perf, m[i].iterations, "op");
+        fprintf(fp, " }%s\n", i + 1 < micro_count ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    Workload        workloads[MAX_WORKLOADS];
+    WorkloadResult  results[MAX_WORKLOADS];
+    MicroResult     micro[MAX_MICRO];
+    int             workload_count = 0, result_count = 0, micro_count;
+    const char*     out_path = "bench.json";
+    FILE*           fp;
+
+    for (u32 i = 0; i < BUILTIN_COUNT; i++) {
+        workloads[workload_count++] = (Workload){ builtin_programs[i].name, NULL, NULL, (u8)i };
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)   frames = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) out_path = argv[++i];
+        else if (strcmp(argv[i], "--perf") == 0 && i + 1 < argc) {
+            i++;
+            perf_mode = strcmp(argv[i], "frame") == 0 ? PERF_FRAME : PERF_RUN;
+        }
+        else if (workload_count < MAX_WORKLOADS) {
+            // rom.gb or rom.gb:movie.amov (the last ':' not followed by a path separator)
+            char* sep = strrchr(argv[i], ':');
+            Workload w = { argv[i], argv[i], NULL, 0 };
+            if (sep && sep[1] != '/' && sep[1] != '\\') {
+                *sep = '\0';
+                w.movie_path = sep + 1;
+            }
+            workloads[workload_count++] = w;
+        }
+    }
+
+    if (SDL_Init(0) < 0) {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        return -1;
+    }
+
+    // Without counters the results are the same, only the perf fields are null
+    if (perf_mode != PERF_OFF && perf_open() == -1) perf_mode = PERF_OFF;
+
+    for (int i = 0; i < workload_count; i++) {
+        if (run_workload(&workloads[i], &results[result_count]) == 0) result_count++;
+        else fprintf(stderr, "Workload %s failed\n", workloads[i].name);
+    }
+    micro_count = run_micro(micro);
+
+    fp = fopen(out_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", out_path);
+        SDL_Quit();
+        return -1;
+    }
+    write_json(fp, results, result_count, micro, micro_count);
+    fclose(fp);
+
+    for (int i = 0; i < result_count; i++) {
+        const PerfSample* p = &results[i].perf;
+        printf("%-24s %8.1f fps %10.0f ns/frame", results[i].name,
+            results[i].frames / (results[i].seconds > 0.0 ? results[i].seconds : 1e-9),
+            results[i].frames ? results[i].seconds * 1e9 / results[i].frames : 0.0);
+        if (p->valid[PERF_CYCLES] && p->valid[PERF_INSTRUCTIONS] && p->value[PERF_CYCLES] && results[i].frames) {
+            printf("  IPC %.2f, %.0f branch misses/frame, %.0f cache misses/frame",
+                (double)p->value[PERF_INSTRUCTIONS] / p->value[PERF_CYCLES],
+                (double)p->value[PERF_BRANCH_MISSES] / results[i].frames, (double)p->value[PERF_CACHE_MISSES] / results[i].frames);
+        }
+        printf("\n");
+    }
+    for (int i = 0; i < micro_count; i++) {
+        if (micro[i].skipped)   printf("%-24s skipped\n", micro[i].name);
+        else                    printf("%-24s %8.2f ns/op\n", micro[i].name, micro[i].ns_per_op);
+    }
+    printf("Results written to %s\n", out_path);
+
+    perf_close();
+    SDL_Quit();
+    return 0;
+}
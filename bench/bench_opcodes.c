@@ -0,0 +1,292 @@
+// Per-opcode benchmark. Runs a stream of each of the 512 opcodes (main and CB page) from WRAM
+// and reports the host cost of every one, along with a check of its emulated cycles.
+//
+// Usage: bench_opcodes [--iterations n] [--sort ns|cycles|opcode] [--csv file.csv]
+//
+// Cycles are checked two ways: the count the instruction returns against op_cycles_lut
+// (taken and not taken for conditional ones), and against the M-cycles it actually ticked.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "../src/cpu.c"
+#include "../src/ppu.c"
+#include "../src/apu.c"
+#include "../src/blip.c"
+#include "../src/timer.c"
+#include "../src/trace.c"
+#include "../src/profiler.c"
+#include "../src/spsc_queue.c"
+#include "../src/timeline.c"
+
+#define STREAM_BASE     0xC000
+#define STREAM_COPIES   256     // of the instruction, back to back
+#define DATA_ADDR       0xC800  // where the 16-bit registers and operands point
+#define STACK_ADDR      0xD000
+#define HRAM_OPERAND    0x80    // a8 operand, LDH stays in HRAM
+#define DEFAULT_ITERATIONS 1000000
+
+typedef enum SortKey {
+    SORT_NS,
+    SORT_CYCLES,
+    SORT_OPCODE
+} SortKey;
+
+typedef struct OpcodeResult {
+    u8      cb;             // 1 = CB page
+    u8      op;
+    u8      skipped;        // illegal opcode
+    u8      expected;       // not taken, from op_cycles_lut (CB page: 8, 12 or 16)
+    u8      expected_taken; // 0 if unconditional
+    u8      min_cycles;
+    u8      max_cycles;
+    u32     lut_mismatches; // returned cycles that match neither expected count
+    u32     tick_mismatches;// returned cycles that differ from the M-cycles ticked
+    double  ns_per_op;
+} OpcodeResult;
+
+u32             iterations = DEFAULT_ITERATIONS;
+OpcodeResult    results[512];
+
+// Helpers ------------------------------------------------------------
+
+u8 is_illegal(u8 op)
+{
+    switch (op) {
+        case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB:
+        case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD:
+            return 1;
+    }
+    return 0;
+}
+
+// Bytes taken by a main page instruction, as this core reads them (STOP has no operand here)
+u8 op_length(u8 op)
+{
+    switch (op) {
+        case 0x01: case 0x08: case 0x11: case 0x21: case 0x31:
+        case 0xC2: case 0xC3: case 0xC4: case 0xCA: case 0xCC: case 0xCD:
+        case 0xD2: case 0xD4: case 0xDA: case 0xDC: case 0xEA: case 0xFA:
+            return 3;
+        case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x36: case 0x3E:
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+        case 0xE0: case 0xF0: case 0xE8: case 0xF8: case 0xCB:
+            return 2;
+    }
+    return 1;
+}
+
+// Extra cycles a conditional instruction takes when its condition holds
+u8 taken_extra(u8 op)
+{
+    switch (op) {
+        case 0x20: case 0x28: case 0x30: case 0x38: // JR cc
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA: // JP cc
+            return 4;
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC: // CALL cc
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8: // RET cc
+            return 12;
+    }
+    return 0;
+}
+
+u8 cb_cycles(u8 op)
+{
+    if ((op & 0x7) != 0x6) return 8;
+    return (op >= 0x40 && op < 0x80) ? 12 : 16; // BIT n,(HL) only reads
+}
+
+// Writes STREAM_COPIES copies of the instruction, jumps and calls go to the next copy
+u8 write_stream(u8 cb, u8 op)
+{
+    u8  length = cb ? 2 : op_length(op);
+    u16 addr = STREAM_BASE;
+
+    for (u32 i = 0; i < STREAM_COPIES; i++) {
+        u16 next = addr + length;
+        wram[(addr + 0) & 0xFFF] = cb ? 0xCB : op;
+        if (cb) wram[(addr + 1) & 0xFFF] = op;
+        else if (length == 2) {
+            u8 jr = op == 0x18 || (op & 0xE7) == 0x20;
+            wram[(addr + 1) & 0xFFF] = jr ? 0x00 : (op == 0xCB ? 0x37 : HRAM_OPERAND);
+        }
+        else if (length == 3) {
+            u16 target = (op >= 0xC0 && op != 0xEA && op != 0xFA) ? next : DATA_ADDR;
+            wram[(addr + 1) & 0xFFF] = target & 0xFF;
+            wram[(addr + 2) & 0xFFF] = target >> 8;
+        }
+        addr = next;
+    }
+    return length;
+}
+
+// Registers at the start of every pass over the stream, flags alternate so both
+// branches of conditional instructions run
+void reset_state(u32 pass)
+{
+    u8 flags = (pass & 1) ? 1 : 0;
+
+    A = 0x5A;
+    F_Z = F_N = F_H = F_C = flags;
+    BC.full = DATA_ADDR + HRAM_OPERAND; // C = 80, LD (C),A stays in HRAM
+    DE.full = DATA_ADDR;
+    HL.full = DATA_ADDR;
+    SP.full = STACK_ADDR;
+    PC = STREAM_BASE;
+    interrupts_enabled = 0;
+    halted = 0;
+}
+
+// Runs one opcode --------------------------------------------------
+
+void run_opcode(u8 cb, u8 op, OpcodeResult* r)
+{
+    u8      length;
+    u16     addr = STREAM_BASE;
+    u32     copy = 0, pass = 0;
+    u8      cycles;
+    u64     start_cycles;
+    Uint64  start;
+
+    memset(r, 0, sizeof(*r));
+    r->cb = cb;
+    r->op = op;
+    r->min_cycles = 0xFF;
+    if (!cb && is_illegal(op)) {
+        r->skipped = 1;
+        return;
+    }
+    r->expected = cb ? cb_cycles(op) : op_cycles_lut[op];
+    if (!cb && op == 0xCB) r->expected = cb_cycles(0x37); // the prefix runs SWAP A
+    r->expected_taken = cb ? 0 : (taken_extra(op) ? op_cycles_lut[op] + taken_extra(op) : 0);
+
+    length = write_stream(cb, op);
+    reset_state(pass);
+
+    start = SDL_GetPerformanceCounter();
+    for (u32 i = 0; i < iterations; i++) {
+        start_cycles = cycles_total;
+        if (cb) {
+            read(PC++); tick();
+            u8 cb_op = read(PC++); tick();
+            cycles = execute_cb(cb_op);
+        }
+        else {
+            u8 fetched = read(PC++); tick();
+            cycles = execute_instruction(fetched);
+        }
+
+        if (cycles < r->min_cycles) r->min_cycles = cycles;
+        if (cycles > r->max_cycles) r->max_cycles = cycles;
+        if (cycles != r->expected && cycles != r->expected_taken) r->lut_mismatches++;
+        if ((u64)cycles != ((cycles_total - start_cycles) << double_speed)) r->tick_mismatches++;
+
+        // Returns, restarts and jumps elsewhere continue with the next copy
+        addr += length;
+        if (++copy == STREAM_COPIES) {
+            copy = 0;
+            addr = STREAM_BASE;
+            reset_state(++pass);
+        }
+        PC = addr;
+        halted = 0;
+    }
+    r->ns_per_op = (double)(SDL_GetPerformanceCounter() - start) * 1e9 / SDL_GetPerformanceFrequency() / iterations;
+}
+
+// Report -------------------------------------------------------------
+
+SortKey sort_key = SORT_NS;
+
+int compare_results(const void* a, const void* b)
+{
+    const OpcodeResult* x = (const OpcodeResult*)a;
+    const OpcodeResult* y = (const OpcodeResult*)b;
+
+    if (x->skipped != y->skipped) return x->skipped - y->skipped;
+    switch (sort_key) {
+        case SORT_NS:
+            if (x->ns_per_op != y->ns_per_op) return x->ns_per_op < y->ns_per_op ? 1 : -1;
+            break;
+        case SORT_CYCLES:
+            if (x->max_cycles != y->max_cycles) return y->max_cycles - x->max_cycles;
+            break;
+        default:
+            break;
+    }
+    return (x->cb * 256 + x->op) - (y->cb * 256 + y->op);
+}
+
+void print_result(FILE* fp, const OpcodeResult* r, u8 csv)
+{
+    const char* format = csv ? "%s%02X,%.3f,%u,%u,%u,%u,%u,%u\n" : "%-4s%02X %10.3f %4u %4u %4u %4u %8u %8u\n";
+
+    if (r->skipped) {
+        if (csv) fprintf(fp, "%s%02X,,,,,,,\n", r->cb ? "CB" : "", r->op);
+        return;
+    }
+    fprintf(fp, format, r->cb ? "CB" : "", r->op, r->ns_per_op, r->min_cycles, r->max_cycles,
+        r->expected, r->expected_taken, r->lut_mismatches, r->tick_mismatches);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* csv_path = NULL;
+    u8*         rom;
+    u32         errors = 0;
+    FILE*       fp;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) csv_path = argv[++i];
+        else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "cycles") == 0)         sort_key = SORT_CYCLES;
+            else if (strcmp(argv[i], "opcode") == 0)    sort_key = SORT_OPCODE;
+            else                                        sort_key = SORT_NS;
+        }
+    }
+    if (iterations == 0) iterations = DEFAULT_ITERATIONS;
+
+    if (SDL_Init(0) < 0) {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        return -1;
+    }
+
+    // Blank 32 KB cartridge, only needed to power up
+    rom = (u8*)calloc(0x8000, 1);
+    if (rom == NULL || apu_init(APU_SAMPLE_RATE) == -1 || cpu_init(rom) == -1 || ppu_init() == -1) {
+        fprintf(stderr, "Failed to power up\n");
+        SDL_Quit();
+        return -1;
+    }
+    apu_set_synthesis(0, cpu_get_cycles());
+
+    for (u32 i = 0; i < 512; i++) {
+        run_opcode(i >> 8, i & 0xFF, &results[i]);
+        if (results[i].lut_mismatches || results[i].tick_mismatches) errors++;
+    }
+    qsort(results, 512, sizeof(OpcodeResult), compare_results);
+
+    printf("op      ns/op  min  max  lut  taken   lut_err  tick_err\n");
+    for (u32 i = 0; i < 512; i++) print_result(stdout, &results[i], 0);
+    printf("%u opcodes with cycle mismatches\n", errors);
+
+    if (csv_path) {
+        fp = fopen(csv_path, "w");
+        if (fp == NULL) fprintf(stderr, "Failed to open file: %s\n", csv_path);
+        else {
+            fprintf(fp, "opcode,ns_per_op,min_cycles,max_cycles,lut_cycles,lut_taken_cycles,lut_mismatches,tick_mismatches\n");
+            for (u32 i = 0; i < 512; i++) print_result(fp, &results[i], 1);
+            fclose(fp);
+        }
+    }
+
+    ppu_cleanup();
+    cpu_cleanup();
+    apu_cleanup();
+    SDL_Quit();
+    return errors ? 1 : 0;
+}
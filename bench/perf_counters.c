@@ -0,0 +1,128 @@
+#include "perf_counters.h"
+
+#include <stdio.h>
+#include <string.h>
+
+const char* perf_names[PERF_COUNTERS] = {
+    "cycles", "instructions", "cache_references", "cache_misses", "branches", "branch_misses"
+};
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+const u32 perf_configs[PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_REFERENCES,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+int     perf_fds[PERF_COUNTERS] = { -1, -1, -1, -1, -1, -1 };
+int     perf_slot[PERF_COUNTERS];   // position in the group read, -1 if not opened
+u32     perf_opened;
+
+// Counts this thread in user space only, which perf_event_paranoid 2 still allows.
+// All counters are one group so they are scheduled, and read, together.
+int perf_open()
+{
+    struct perf_event_attr attr;
+
+    perf_close();
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+        int leader = perf_fds[PERF_CYCLES];
+
+        perf_slot[i] = -1;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = perf_configs[i];
+        attr.disabled = (i == PERF_CYCLES);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        perf_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (perf_fds[i] == -1) {
+            if (i == PERF_CYCLES) {
+                perror("perf_event_open");
+                fprintf(stderr, "Hardware counters unavailable, running without them\n");
+                return -1;
+            }
+            continue;   // the others are optional
+        }
+        perf_slot[i] = perf_opened++;
+    }
+    ioctl(perf_fds[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fds[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 0;
+}
+
+void perf_close()
+{
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+        if (perf_fds[i] != -1) close(perf_fds[i]);
+        perf_fds[i] = -1;
+    }
+    perf_opened = 0;
+}
+
+u8 perf_available()
+{
+    return perf_fds[PERF_CYCLES] != -1;
+}
+
+// Running totals, scaled up when the kernel multiplexed the group
+void perf_read(PerfSample* out)
+{
+    u64     data[3 + PERF_COUNTERS];   // nr, time enabled, time running, values
+    double  scale = 1.0;
+
+    memset(out, 0, sizeof(*out));
+    if (!perf_available()) return;
+    // Raw syscall, the bench links the core whose read() would be picked instead
+    if (syscall(SYS_read, perf_fds[PERF_CYCLES], data, sizeof(data)) < (long)((3 + perf_opened) * sizeof(u64))) return;
+    if (data[2] == 0) return;   // never scheduled
+    if (data[2] < data[1]) scale = (double)data[1] / data[2];
+
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+        if (perf_slot[i] < 0) continue;
+        out->value[i] = (u64)(data[3 + perf_slot[i]] * scale);
+        out->valid[i] = 1;
+    }
+}
+#else
+int perf_open()
+{
+    fprintf(stderr, "Hardware counters are only supported on Linux, running without them\n");
+    return -1;
+}
+void perf_close() {}
+u8 perf_available() { return 0; }
+void perf_read(PerfSample* out) { memset(out, 0, sizeof(*out)); }
+#endif
+
+void perf_diff(const PerfSample* start, const PerfSample* end, PerfSample* out)
+{
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+        out->valid[i] = start->valid[i] && end->valid[i];
+        out->value[i] = out->valid[i] ? end->value[i] - start->value[i] : 0;
+    }
+}
+
+void perf_add(PerfSample* total, const PerfSample* delta)
+{
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+        total->value[i] += delta->value[i];
+        total->valid[i] = delta->valid[i];
+    }
+}
+
+const char* perf_counter_name(PerfCounter counter)
+{
+    return perf_names[counter];
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+// Hardware counters through Linux perf_event_open, for the benchmarks.
+// Elsewhere, or when the kernel refuses (perf_event_paranoid, containers, VMs),
+// perf_open fails and the benchmarks run without them.
+#include "alu_binary.h"
+#include "macros.h"
+
+typedef enum PerfCounter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_REFERENCES,
+    PERF_CACHE_MISSES,
+    PERF_BRANCHES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTERS
+} PerfCounter;
+
+typedef struct PerfSample {
+    u64 value[PERF_COUNTERS];
+    u8  valid[PERF_COUNTERS];   // counter opened and scheduled
+} PerfSample;
+
+int perf_open();
+void perf_close();
+u8 perf_available();
+
+void perf_read(PerfSample* out);
+void perf_diff(const PerfSample* start, const PerfSample* end, PerfSample* out);
+void perf_add(PerfSample* total, const PerfSample* delta);
+
+const char* perf_counter_name(PerfCounter counter);
+
+#endif PERF_COUNTERS_H
\ No newline at end of file
@@ -3,7 +3,34 @@
 #ifndef APPLICATION_H
 #define APPLICATION_H
 
-int application_init(const char* title);
+#include "alu_binary.h"
+
+// Input latency: key presses are applied at their host time plus a fixed lead of one frame
+// and 1 ms, the same for every input. The core runs a whole frame at each frame start, so an
+// input can only be placed after the frame it happened in, and a lead below a frame would
+// have to drop back to the frame start for early inputs, which varies the delay again.
+// Inputs that reach the queue more than the lead late (the render thread polls events once
+// per swap, or stalled) apply at the next frame start instead.
+typedef struct AppOptions {
+    const char* rom_path;
+    u8          headless;   // no window or audio device, runs uncapped
+    u32         frames;     // frames to run in headless mode
+    const char* wav_path;   // audio capture, NULL for none
+    const char* record_path;// input movie to record, NULL for none
+    const char* play_path;  // input movie to play, NULL for none
+    u8          frame_hashes; // store a hash of every frame in the recorded movie
+    u8          uncapped;   // no frame pacing
+    u8          counters;   // print the hot path counters every second (needs ALU_COUNTERS)
+    const char* trace_path; // instruction trace saved on exit, NULL for none
+    u32         trace_size; // records kept in the trace ring, 0 for the default
+    const char* profile_path;   // guest profile (folded stacks) saved on exit, NULL for none
+    u32         profile_interval; // dots between samples, 0 for the default
+    const char* sym_path;   // symbol names for the profile, NULL for none
+    const char* timeline_path;  // host frame timeline (Chrome trace JSON), NULL for none
+    u8          pbo_upload; // start streaming through the PBO ring instead of direct uploads, F10 toggles
+} AppOptions;
+
+int application_init(const char* title, const AppOptions* app_options);
 void application_cleanup();
 void application_draw();
 void application_update();
@@ -0,0 +1,31 @@
+#pragma once
+
+#ifndef APU_H
+#define APU_H
+
+// Audio processing unit.
+// Channels only advance when a register is accessed or samples are requested,
+// timestamps are master clock dots (see cpu_get_cycles).
+#include "alu_binary.h"
+#include "macros.h"
+
+#define APU_SAMPLE_RATE     48000
+#define APU_MAX_SAMPLES     4096    // per channel (left/right) buffered before the oldest are dropped
+
+int apu_init(int sample_rate);
+void apu_reset(u64 now);
+void apu_cleanup();
+
+u8 apu_read(u8 addr, u64 now);
+void apu_write(u8 addr, u8 value, u64 now);
+void apu_div_reset(u8 div, u64 now);
+void apu_sync_div(u16 counter, u8 double_speed, u64 now);
+
+void apu_set_synthesis(u8 enabled, u64 now);
+void apu_set_rate_adjust(double ratio);
+
+void apu_end_frame(u64 now);
+int apu_samples_avail();
+int apu_read_samples(s16* out, int count);
+
+#endif APU_H
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+// Audio output. The emulation thread pushes samples into a lock-free ring
+// which the SDL audio callback drains.
+#include "alu_binary.h"
+#include "macros.h"
+
+#define AUDIO_RING_FRAMES   8192    // stereo sample pairs, ~170ms at 48 kHz
+#define AUDIO_TARGET_FRAMES 2048    // fill level the rate control aims for
+#define AUDIO_MAX_ADJUST    0.005   // +-0.5% of the output rate
+
+typedef struct AudioStats {
+    u32     underruns;  // callbacks that ran out of samples
+    u32     overruns;   // pushes that did not fit in the ring
+    u32     fill;       // sample pairs currently queued
+    double  ratio;      // current output rate adjustment
+} AudioStats;
+
+int audio_init(int sample_rate);
+void audio_cleanup();
+
+void audio_push(const s16* samples, int count);
+void audio_set_rate_control(u8 enabled);
+
+void audio_get_stats(AudioStats* stats);
+void audio_print_stats();
+
+#endif AUDIO_H
\ No newline at end of file
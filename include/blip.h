@@ -0,0 +1,38 @@
+#pragma once
+
+#ifndef BLIP_H
+#define BLIP_H
+
+// Band-limited step synthesis.
+// Amplitude changes are added at the clock they happen, as band-limited steps,
+// and turned into samples at the output rate when they are read.
+#include "alu_binary.h"
+#include "macros.h"
+
+#define BLIP_PHASE_BITS     5   // sub-sample positions of a step
+#define BLIP_HALF_WIDTH     8   // half the length of a step kernel, in samples
+#define BLIP_KERNEL_BITS    15  // kernel taps are fixed point, summing to 1 << BLIP_KERNEL_BITS
+
+typedef struct BlipBuffer {
+    s32*    buffer;     // deltas, integrated when read
+    int     capacity;   // in samples
+    int     avail;      // samples ready to be read
+    u64     factor;     // output samples per clock, 32.32 fixed point
+    u64     offset;     // fraction of a sample at which the current frame starts, 32.32
+    s32     integrator;
+    s32     high_pass;
+} BlipBuffer;
+
+int blip_init(BlipBuffer* b, int capacity);
+void blip_cleanup(BlipBuffer* b);
+
+void blip_set_rates(BlipBuffer* b, double clock_rate, double sample_rate);
+void blip_clear(BlipBuffer* b);
+
+void blip_add_delta(BlipBuffer* b, u32 time, int delta);
+void blip_end_frame(BlipBuffer* b, u32 clocks);
+int blip_clocks_needed(BlipBuffer* b, int samples);
+
+int blip_read_samples(BlipBuffer* b, s16* out, int count, int stride);
+
+#endif BLIP_H
\ No newline at end of file
@@ -0,0 +1,72 @@
+#pragma once
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+// Hot path counters. The COUNT_ macros compile to nothing unless ALU_COUNTERS is defined,
+// the query functions then report zeros.
+#include "alu_binary.h"
+#include "macros.h"
+#include "emu_shared.h"
+
+// Memory regions, by CPU address
+enum CounterRegion {
+    REGION_ROM0,    // 0000-3FFF
+    REGION_ROMN,    // 4000-7FFF
+    REGION_VRAM,    // 8000-9FFF
+    REGION_ERAM,    // A000-BFFF
+    REGION_WRAM,    // C000-FDFF, echo included
+    REGION_OAM,     // FE00-FEFF, unusable area included
+    REGION_IO,      // FF00-FF7F and IE
+    REGION_HRAM,    // FF80-FFFE
+    REGION_COUNT
+};
+
+typedef struct Counters {
+    u64 opcodes[0x100];
+    u64 cb_opcodes[0x100];
+    u64 reads[REGION_COUNT];
+    u64 writes[REGION_COUNT];
+    u64 rom_bank_switches;
+    u64 eram_bank_switches;
+    u64 interrupts[5];      // by InterruptBit
+    u64 halt_cycles;
+    u64 dma_transfers;
+} Counters;
+
+#ifdef ALU_COUNTERS
+extern Counters counters;
+extern const u8 counter_region_lut[0x10];
+
+#define COUNTER_REGION(addr)    ((addr) < MEM_OAM ? counter_region_lut[(addr) >> 12] : \
+                                 (addr) < MEM_IO ? REGION_OAM : \
+                                 ((addr) >= MEM_HRAM && (addr) < MEM_IE) ? REGION_HRAM : REGION_IO)
+#define COUNT_OPCODE(op)        (counters.opcodes[(op)]++)
+#define COUNT_CB_OPCODE(op)     (counters.cb_opcodes[(op)]++)
+#define COUNT_READ(addr)        (counters.reads[COUNTER_REGION(addr)]++)
+#define COUNT_WRITE(addr)       (counters.writes[COUNTER_REGION(addr)]++)
+#define COUNT_BANK_SWITCH(rom_changed, eram_changed) \
+                                (counters.rom_bank_switches += (rom_changed) != 0, \
+                                 counters.eram_bank_switches += (eram_changed) != 0)
+#define COUNT_INTERRUPT(bit)    (counters.interrupts[(bit)]++)
+#define COUNT_HALT(cycles)      (counters.halt_cycles += (cycles))
+#define COUNT_DMA()             (counters.dma_transfers++)
+#else
+#define COUNT_OPCODE(op)                            ((void)0)
+#define COUNT_CB_OPCODE(op)                         ((void)0)
+#define COUNT_READ(addr)                            ((void)0)
+#define COUNT_WRITE(addr)                           ((void)0)
+#define COUNT_BANK_SWITCH(rom_changed, eram_changed) ((void)0)
+#define COUNT_INTERRUPT(bit)                        ((void)0)
+#define COUNT_HALT(cycles)                          ((void)0)
+#define COUNT_DMA()                                 ((void)0)
+#endif
+
+u8 counters_enabled();
+void counters_get(Counters* out);
+void counters_reset();
+
+void counters_print(const Counters* c, double seconds);
+void counters_update();
+
+#endif COUNTERS_H
\ No newline at end of file
@@ -4,10 +4,42 @@
 #define CPU_H
 
 #include "alu_binary.h"
+#include "macros.h"
+
+// Joypad buttons, bit positions in a button mask (same order as the inputs array)
+enum Button {
+    BTN_RIGHT,
+    BTN_LEFT,
+    BTN_UP,
+    BTN_DOWN,
+    BTN_A,
+    BTN_B,
+    BTN_SELECT,
+    BTN_START
+};
+
+// A change of the pressed buttons, stamped with the emulated cycle it applies at
+typedef struct InputEvent {
+    u64 cycle;
+    u8  buttons;    // 1 = pressed, see Button
+} InputEvent;
 
 int cpu_init(u8* rom_buffer);
 
-void cpu_update(u8* inputs);
+void cpu_step();
+void gb_run_cycles(u64 dots);
+void gb_run_until_vblank();
+
+void cpu_set_buttons(u8 buttons);
+int cpu_queue_input(const InputEvent* event);
+
+u64 cpu_get_cycles();
+u64 cpu_get_instructions();
+u8 cpu_get_cgb_flag();
+void cpu_set_sample_interval(u32 dots);
+
+// Called by the PPU at the start of every HBlank
+void cpu_hblank();
 
 void cpu_cleanup();
 
@@ -213,5 +213,7 @@ extern u8  oam[0xA0];
 
 extern u8  cpu_mode;       // vblank/hblank/oam search/pixel rendering...
 extern u8  interrupts_enabled; // IME flag
+extern u8  vblank_reached; // set by the PPU when LY reaches 144
+extern u8  cgb_flag;       // running in CGB mode
 
 #endif EMU_SHARED_H
\ No newline at end of file
@@ -7,6 +7,22 @@
 #include <GL/glew.h>
 
 #include "alu_binary.h"
+#include "ppu.h"
+
+#define MAX_PALETTE_COLORS 64
+#define PBO_COUNT 3 // Pixel buffer objects in the upload ring
+
+typedef enum UploadMode {
+    UPLOAD_DIRECT,  // glTexSubImage2D from client memory, may stall until the GPU is idle
+    UPLOAD_PBO      // Streams through a ring of pixel buffer objects
+} UploadMode;
+
+// Host time spent in a stage of the frame, in milliseconds
+typedef struct FrameTimeStats {
+    u32     count;
+    double  total_ms;
+    double  max_ms;
+} FrameTimeStats;
 
 // Wrapper macro for gl_ functions, prints out the errors
 #define GL_CALL(func) \
@@ -22,7 +38,18 @@ int graphics_init(SDL_Window* window);
 void graphics_cleanup();
 void graphics_draw(SDL_Window* window);
 
-void graphics_update_rgba_buffer(u8 * color_index_buffer);
+const SDL_Color* graphics_get_palette();
+void graphics_set_palette(const SDL_Color* colors, int count);
+
+void graphics_set_pixel_format(PixelFormat format);
+PixelFormat graphics_get_pixel_format();
+
+void graphics_set_upload_mode(UploadMode mode);
+UploadMode graphics_get_upload_mode();
+void graphics_get_frame_stats(FrameTimeStats* upload, FrameTimeStats* present);
+void graphics_print_frame_stats();
+
+void graphics_update_rgba_buffer(u8* pixel_buffer);
 
 #endif GRAPHICS_H
 
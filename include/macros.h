@@ -6,6 +6,15 @@
 #define SCREEN_WIDTH    160
 #define SCREEN_HEIGHT   144
 
+// alu_binary.h only defines s8/u8/u16/u32
+typedef short               s16;
+typedef int                 s32;
+typedef unsigned long long  u64;
+typedef long long           s64;
+
+// Master clock value of an event that never happens
+#define CYCLES_NEVER    0xFFFFFFFFFFFFFFFFULL
+
 // For testing - exposes private functions
 #ifdef TESTING
 #define TEST_STATIC static
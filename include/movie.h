@@ -0,0 +1,32 @@
+#pragma once
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+// Input movies: the button mask applied at the start of every frame, run-length encoded,
+// for the ROM they were recorded on. Optionally with a hash of every frame to verify playback.
+#include "alu_binary.h"
+#include "macros.h"
+
+#define MOVIE_VERSION       1
+#define MOVIE_MAX_RUN       0xFFFF  // frames per run, longer runs are split
+
+// Emulator state a movie starts from
+enum MovieStart {
+    MOVIE_START_POWER_ON
+};
+
+int movie_record_start(const char* path, const u8* rom, u32 rom_size, u8 frame_hashes);
+int movie_play_start(const char* path, const u8* rom, u32 rom_size);
+void movie_stop();
+
+u8 movie_recording();
+u8 movie_playing();
+
+void movie_record_frame(u8 buttons);
+int movie_next_frame(u8* buttons);
+void movie_frame_done(const u8* pixels, u32 size);
+
+u64 movie_hash(const u8* data, u32 size);
+
+#endif MOVIE_H
\ No newline at end of file
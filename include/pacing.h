@@ -0,0 +1,41 @@
+#pragma once
+
+#ifndef PACING_H
+#define PACING_H
+
+// Frame pacing against the high resolution performance counter
+#include "alu_binary.h"
+#include "macros.h"
+
+#define DMG_CLOCK_HZ    4194304.0
+#define DMG_FRAME_DOTS  70224.0
+#define DMG_FRAME_HZ    (DMG_CLOCK_HZ / DMG_FRAME_DOTS) // 59.7275 Hz
+
+typedef enum PacingMode {
+    PACING_NATIVE,  // the true DMG frame rate
+    PACING_VSYNC    // the display refresh rate, when it is close enough to the DMG rate
+} PacingMode;
+
+// Host time between frames, in milliseconds
+typedef struct PacingStats {
+    u32     frames;
+    double  target_ms;
+    double  mean_ms;
+    double  stddev_ms;
+    double  min_ms;
+    double  max_ms;
+} PacingStats;
+
+void pacing_init(double target_hz);
+void pacing_set_target(double target_hz);
+double pacing_get_target();
+int pacing_match_refresh(double refresh_hz);
+
+void pacing_wait();
+s64 pacing_cycles_from_frame(u64 host_time);
+
+void pacing_get_stats(PacingStats* stats);
+void pacing_reset_stats();
+void pacing_print_stats();
+
+#endif PACING_H
\ No newline at end of file
@@ -13,15 +13,30 @@ typedef enum BufferType {
     WINDOW_BUFFER
 } BufferType;
 
+// Pixel formats the frontend can register for the PPU output
+typedef enum PixelFormat {
+    PIXEL_FORMAT_INDEX,     // 1 byte per pixel: shade 0-3 after applying BGP/OBP0/OBP1
+    PIXEL_FORMAT_RGBA8888,  // 4 bytes per pixel: r,g,b,a in memory order
+    PIXEL_FORMAT_RGB565     // 2 bytes per pixel: rrrrrggggggbbbbb
+} PixelFormat;
+
 int ppu_init();
 
+void ppu_set_output_format(PixelFormat format, const SDL_Color* colors);
+PixelFormat ppu_get_output_format();
+
 u8* ppu_get_pixel_buffer();
+u32 ppu_get_pixel_buffer_size();
 
 u8 ppu_get_redraw_flag();
 void ppu_set_redraw_flag(u8 val);
 
 void ppu_update(u8 cycles);
 
+// CGB palette data (BGPD / OBPD), obj selects the OBJ palettes
+void ppu_write_palette(u8 obj, u8 value);
+u8 ppu_read_palette(u8 obj);
+
 void ppu_cleanup();
 
 #endif PPU_H
\ No newline at end of file
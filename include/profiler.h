@@ -0,0 +1,29 @@
+#pragma once
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Guest profiler. Samples the guest PC every interval dots and attributes the sample to
+// the guest call stack, which is followed through CALL/RST/RET and interrupt entry.
+// Saves folded stacks (flamegraph.pl, speedscope) and prints the hottest bank:PC spots.
+#include "alu_binary.h"
+#include "macros.h"
+
+#define PROFILER_DEFAULT_INTERVAL   997 // dots, prime so loops and frames do not alias with it
+#define PROFILER_MAX_DEPTH          64  // deeper calls count toward the deepest frame
+#define PROFILER_HOT_SPOTS          20  // printed by profiler_save
+
+// Read by the CPU on every call and return
+extern u8 profiling;
+
+int profiler_start(u32 interval, const char* sym_path);
+void profiler_stop();
+int profiler_save(const char* path);
+u32 profiler_interval();
+
+// CPU hooks, addresses are bank:address where the bank is the ROM bank at 4000-7FFF
+void profiler_sample(u16 pc, u16 bank);
+void profiler_call(u16 target, u16 bank, u16 sp);
+void profiler_return(u16 sp);
+
+#endif PROFILER_H
\ No newline at end of file
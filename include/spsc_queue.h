@@ -0,0 +1,32 @@
+#pragma once
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+// Lock-free single producer / single consumer ring of fixed size elements.
+// One thread may push while another pops, without any locking.
+#include <SDL.h>
+
+#include "alu_binary.h"
+
+typedef struct SPSCQueue {
+    u8*         data;
+    u32         elem_size;
+    u32         capacity;   // power of 2
+    SDL_atomic_t head;      // next slot to pop, written by the consumer
+    SDL_atomic_t tail;      // next slot to push, written by the producer
+} SPSCQueue;
+
+int spsc_init(SPSCQueue* q, u32 elem_size, u32 capacity);
+void spsc_cleanup(SPSCQueue* q);
+
+int spsc_push(SPSCQueue* q, const void* elem);
+int spsc_pop(SPSCQueue* q, void* elem);
+
+int spsc_push_n(SPSCQueue* q, const void* elems, u32 count);
+u32 spsc_pop_n(SPSCQueue* q, void* elems, u32 count);
+
+u32 spsc_count(SPSCQueue* q);
+u32 spsc_free(SPSCQueue* q);
+
+#endif SPSC_QUEUE_H
\ No newline at end of file
@@ -0,0 +1,32 @@
+#pragma once
+
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+// Host frame timeline in Chrome trace-event JSON (chrome://tracing, Perfetto).
+// Every thread pushes its events into its own lock-free queue, a writer thread
+// formats them to disk. Recording can be paused and resumed at any time.
+#include "alu_binary.h"
+#include "macros.h"
+
+#define TIMELINE_QUEUE_EVENTS   (1 << 16)   // per thread
+
+// Threads that record, each one only pushes to its own queue
+typedef enum TimelineThread {
+    TIMELINE_RENDER,
+    TIMELINE_EMULATION,     // the core runs here (on the main thread in headless mode)
+    TIMELINE_THREADS
+} TimelineThread;
+
+int timeline_start(const char* path);
+void timeline_stop();
+
+void timeline_set_recording(u8 recording);
+u8 timeline_recording();
+
+// Names must be string literals, only the pointer is queued
+void timeline_begin(TimelineThread thread, const char* name);
+void timeline_end(TimelineThread thread, const char* name);
+void timeline_instant(TimelineThread thread, const char* name, u32 arg);
+
+#endif TIMELINE_H
\ No newline at end of file
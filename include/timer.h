@@ -0,0 +1,21 @@
+#pragma once
+
+#ifndef TIMER_H
+#define TIMER_H
+
+// DIV and TIMA, derived from the master clock when accessed.
+// Between accesses the only work left is the overflow, scheduled as an event.
+#include "alu_binary.h"
+#include "macros.h"
+
+void timer_reset(u64 now);
+
+u8 timer_read(u8 addr, u64 now);
+void timer_write(u8 addr, u8 value, u64 now);
+void timer_set_speed(u8 double_speed, u64 now);
+u16 timer_counter(u64 now);
+
+u64 timer_next_overflow();
+void timer_overflow();
+
+#endif TIMER_H
\ No newline at end of file
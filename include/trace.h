@@ -0,0 +1,49 @@
+#pragma once
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// Binary instruction trace. The CPU stores one record per instruction into a ring,
+// the newest trace_capacity records are kept and saved on request.
+// tools/trace_decode turns a saved trace into gameboy-doctor lines.
+#include "alu_binary.h"
+#include "macros.h"
+
+#define TRACE_VERSION       1
+#define TRACE_DEFAULT_SIZE  (1 << 20)   // records, 32 MB
+
+// CPU state before an instruction executes, 32 bytes
+typedef struct TraceRecord {
+    u64 cycle;      // master clock
+    u16 pc;
+    u16 sp;
+    u16 af;
+    u16 bc;
+    u16 de;
+    u16 hl;
+    u16 bank;       // ROM bank mapped at 4000-7FFF
+    u8  bytes[4];   // memory at PC
+    u8  reserved[6];
+} TraceRecord;
+
+// File layout: "ATRC", u32 version, u32 record size, u32 reserved, u64 record count,
+// then the records oldest first, little endian
+typedef struct TraceHeader {
+    char    magic[4];
+    u32     version;
+    u32     record_size;
+    u32     reserved;
+    u64     count;
+} TraceHeader;
+
+// Read by the CPU on every instruction, trace_ring is NULL while not tracing
+extern TraceRecord* trace_ring;
+extern u32          trace_mask;
+extern u64          trace_head;
+
+int trace_start(u32 capacity);
+void trace_stop();
+int trace_save(const char* path);
+u64 trace_count();
+
+#endif TRACE_H
\ No newline at end of file
@@ -0,0 +1,32 @@
+#pragma once
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+// Lock-free triple buffer. The producer always has a buffer to write into,
+// the consumer always gets the most recently published one.
+#include <SDL.h>
+
+#include "alu_binary.h"
+#include "macros.h"
+
+typedef struct TripleBuffer {
+    u8*         buffers[3];
+    u64         cycles[3];  // emulated cycle at which each frame was published
+    u32         size;
+    u8          write_index;    // owned by the producer
+    u8          read_index;     // owned by the consumer
+    SDL_atomic_t state;         // bits 0-1: index of the ready buffer, bit 2: it holds a new frame
+} TripleBuffer;
+
+int triple_buffer_init(TripleBuffer* tb, u32 size);
+void triple_buffer_cleanup(TripleBuffer* tb);
+
+u8* triple_buffer_write_ptr(TripleBuffer* tb);
+void triple_buffer_publish(TripleBuffer* tb, u64 cycle);
+
+int triple_buffer_consume(TripleBuffer* tb);
+u8* triple_buffer_read_ptr(TripleBuffer* tb);
+u64 triple_buffer_read_cycle(TripleBuffer* tb);
+
+#endif TRIPLE_BUFFER_H
\ No newline at end of file
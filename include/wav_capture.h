@@ -0,0 +1,26 @@
+#pragma once
+
+#ifndef WAV_CAPTURE_H
+#define WAV_CAPTURE_H
+
+// Records the audio stream to disk. Samples go through a bounded lock-free queue
+// to a writer thread, so the emulation thread never waits on the disk.
+#include "alu_binary.h"
+#include "macros.h"
+
+#define CAPTURE_QUEUE_FRAMES    (1 << 17)   // stereo sample pairs, ~2.7s at 48 kHz
+#define CAPTURE_MAX_DROP_EVENTS 64
+
+// Samples lost because the writer fell behind
+typedef struct DropEvent {
+    u64 position;   // stereo sample pair index in the stream where the gap is
+    u32 count;      // sample pairs dropped
+} DropEvent;
+
+int wav_capture_start(const char* path, int sample_rate);
+void wav_capture_stop();
+u8 wav_capture_active();
+
+void wav_capture_push(const s16* samples, int count);
+
+#endif WAV_CAPTURE_H
\ No newline at end of file
@@ -13,22 +13,55 @@
 #include "graphics.h"
 #include "cpu.h"
 #include "ppu.h"
-
+#include "apu.h"
+#include "audio.h"
+#include "pacing.h"
+#include "spsc_queue.h"
+#include "triple_buffer.h"
+#include "wav_capture.h"
+#include "movie.h"
+#include "counters.h"
+#include "trace.h"
+#include "profiler.h"
+#include "timeline.h"
+
+#define INPUT_QUEUE_SIZE 64
+#define INPUT_LEAD_DOTS  ((s64)(DMG_FRAME_DOTS + DMG_CLOCK_HZ / 1000)) // one frame plus 1 ms of pacing jitter
+
+
+// A change of the pressed buttons, stamped with the host time it happened at
+typedef struct HostInput {
+    u64 time;       // performance counter
+    u8  buttons;
+} HostInput;
+
+AppOptions  options;
 
 SDL_Window* window = NULL;
 SDL_Event   window_event;
-const Uint8* kb_state;
 
-int         fps = 60;
-double      tick_rate = 1000.0 / 60.0; // Milliseconds per frame
+PacingMode  pacing_mode = PACING_VSYNC; // PACING_NATIVE to ignore the display refresh rate
 
 int         window_scale = 4;
 
+// Emulation thread
+SDL_Thread*     emu_thread = NULL;
+SDL_atomic_t    emu_running;
+TripleBuffer    frames;         // completed frames, emulation -> render thread
+SPSCQueue       input_queue;    // HostInput, render -> emulation thread
+s16             audio_buffer[APU_MAX_SAMPLES * 2]; // emulation thread (main thread when headless)
+
+// Measured display refresh, for matching the emulation rate (render thread)
+Uint64          swap_prev = 0;
+double          refresh_ms = 0.0;
+u32             swap_count = 0;
+
 
 int EventFilter(void* userdata, SDL_Event* event) {
     // Process SDL_QUIT event
     if (event->type == SDL_QUIT 
         || event->type == SDL_KEYDOWN 
+        || event->type == SDL_KEYUP
         || event->type == SDL_MOUSEMOTION) {
         return 1; // Allow SDL_QUIT event to be processed
     }
@@ -39,8 +72,9 @@ int EventFilter(void* userdata, SDL_Event* event) {
 
 /// <summary>
 /// Stores the contents of a file into a buffer and returns a pointer to it.
+/// The file size is written to size.
 /// </summary>
-u8* LoadROM(const char* fname) {
+u8* LoadROM(const char* fname, long* size) {
     u8*     buffer;
     size_t  bytes_read;
     long    buffer_size;
@@ -85,13 +119,13 @@ u8* LoadROM(const char* fname) {
 
 
     fclose(fp);
+    *size = buffer_size;
     return buffer;
     
 }
 
-int application_init(const char* title) {
-    
-    u8* rom_buffer;
+// Window, OpenGL and audio output, skipped in headless mode
+int init_video(const char* title) {
 
     // Initialize SDL Video
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
@@ -115,8 +149,6 @@ int application_init(const char* title) {
 
     // Set the event filter
     //SDL_SetEventFilter(EventFilter, NULL); // NULL for user data
-    int num_keys;
-    kb_state = SDL_GetKeyboardState(&num_keys);
     
     // Initialize OpenGL stuff
     if (!graphics_init(window))
@@ -125,15 +157,57 @@ int application_init(const char* title) {
         SDL_Quit();
         return -1;
     }
+    graphics_set_upload_mode(options.pbo_upload ? UPLOAD_PBO : UPLOAD_DIRECT);
+
+    // Audio output is optional
+    if (audio_init(APU_SAMPLE_RATE) == -1)
+    {
+        fprintf(stderr, "No audio device, running without sound\n");
+    }
+    return 0;
+}
+
+// Tears down what init_video created
+void cleanup_video() {
+    audio_cleanup();
+    graphics_cleanup();
+    if (window) SDL_DestroyWindow(window);
+    window = NULL;
+}
+
+int application_init(const char* title, const AppOptions* app_options) {
+    
+    u8*     rom_buffer;
+    long    rom_size;
+    PixelFormat format;
+
+    options = *app_options;
+    if (options.counters && !counters_enabled()) {
+        fprintf(stderr, "Counters are not compiled in, define ALU_COUNTERS\n");
+        options.counters = 0;
+    }
+    if (options.headless) {
+        if (SDL_Init(0) < 0)
+        {
+            fprintf(stderr, "%s\n", SDL_GetError());
+            return -1;
+        }
+    }
+    else if (init_video(title) == -1) return -1;
 
     // Open rom
-    //rom_buffer = LoadROM("C:/dev/AluBoy/AluBoy/resources/roms/Pokemon Red.gb");
-    rom_buffer = LoadROM("C:/dev/AluBoy/AluBoy/resources/roms/Tetris (World) (Rev 1).gb");
-    //u8* rom_buffer = LoadROM("C:/dev/AluBoy/AluBoy/resources/roms/start_inc_1_cgb04c_out1E.gbc");
+    rom_buffer = LoadROM(options.rom_path, &rom_size);
     if (rom_buffer == NULL)
     {
-        graphics_cleanup();
-        SDL_DestroyWindow(window);
+        if (!options.headless) cleanup_video();
+        SDL_Quit();
+        return -1;
+    }
+
+    // Initialize emulator apu (before the cpu, which resets it on power up)
+    if (apu_init(APU_SAMPLE_RATE) == -1)
+    {
+        if (!options.headless) cleanup_video();
         SDL_Quit();
         return -1;
     }
@@ -141,8 +215,8 @@ int application_init(const char* title) {
     // Initialize emulator cpu
     if (cpu_init(rom_buffer) == -1)
     {
-        graphics_cleanup();
-        SDL_DestroyWindow(window);
+        apu_cleanup();
+        if (!options.headless) cleanup_video();
         SDL_Quit();
         return -1;
     }
@@ -151,27 +225,218 @@ int application_init(const char* title) {
     if (ppu_init() == -1)
     {
         cpu_cleanup();
-        graphics_cleanup();
-        SDL_DestroyWindow(window);
+        apu_cleanup();
+        if (!options.headless) cleanup_video();
+        SDL_Quit();
+        return -1;
+    }
+    // Audio capture, at the nominal rate so the file only depends on emulated time
+    if (options.wav_path) {
+        if (wav_capture_start(options.wav_path, APU_SAMPLE_RATE) == -1) options.wav_path = NULL;
+        else if (!options.headless) audio_set_rate_control(0);
+    }
+
+    if (options.headless && !options.wav_path) {
+        // Nothing listens, keep only the sound state games can observe
+        apu_set_synthesis(0, cpu_get_cycles());
+    }
+
+    // One pixel format per cartridge type, windowed or headless: movie frame hashes are
+    // taken over the pixel buffer and must match between both. CGB colors need RGBA.
+    format = cpu_get_cgb_flag() ? PIXEL_FORMAT_RGBA8888 : PIXEL_FORMAT_INDEX;
+    if (!options.headless) graphics_set_pixel_format(format);
+    ppu_set_output_format(format, graphics_get_palette());
+
+    // Buffers shared between the emulation and render threads
+    if (triple_buffer_init(&frames, SCREEN_WIDTH * SCREEN_HEIGHT * 4) == -1 
+        || spsc_init(&input_queue, sizeof(HostInput), INPUT_QUEUE_SIZE) == -1)
+    {
+        wav_capture_stop();
+        ppu_cleanup();
+        cpu_cleanup();
+        apu_cleanup();
+        if (!options.headless) cleanup_video();
         SDL_Quit();
         return -1;
     }
 
+    // Instruction trace, profile, timeline and input movie, from power on
+    if ((options.trace_path && trace_start(options.trace_size) == -1)
+        || (options.profile_path && profiler_start(options.profile_interval, options.sym_path) == -1)
+        || (options.timeline_path && timeline_start(options.timeline_path) == -1)
+        || (options.play_path && movie_play_start(options.play_path, rom_buffer, rom_size) == -1)
+        || (options.record_path && movie_record_start(options.record_path, rom_buffer, rom_size, options.frame_hashes) == -1))
+    {
+        application_cleanup();
+        return -1;
+    }
+    cpu_set_sample_interval(profiler_interval());
+
+    return 0;
+}
+
+
+// Movie input for the frame about to run
+void apply_movie_frame(u8 host_buttons)
+{
+    u8 buttons;
+
+    if (movie_playing()) {
+        movie_next_frame(&buttons);
+        cpu_set_buttons(buttons);
+    }
+    else if (movie_recording()) {
+        // Movies store the buttons at frame starts, so the input is applied there too
+        cpu_set_buttons(host_buttons);
+        movie_record_frame(host_buttons);
+    }
+}
+
+// Runs the emulator core. Completed frames are published to the triple buffer,
+// so a stalled swap on the render thread never holds up emulation.
+int emulation_thread(void* data)
+{
+    int   samples;
+    s64   offset;
+    u64   frame_start;
+    u8    host_buttons      = 0;
+    HostInput   input;
+    InputEvent  event;
+
+    while (SDL_AtomicGet(&emu_running)) {
+        // Stalls the program when its running too fast
+        if (!options.uncapped) {
+            timeline_begin(TIMELINE_EMULATION, "pacing");
+            pacing_wait();
+            timeline_end(TIMELINE_EMULATION, "pacing");
+        }
+        frame_start = cpu_get_cycles();
+
+        // Host input mapped to emulated time is in the past by now. Every input is delayed by
+        // the same INPUT_LEAD_DOTS, which keeps one from anywhere in the previous frame in the
+        // future, so the latency is constant (see application.h). Older ones apply at the frame start.
+        while (spsc_pop(&input_queue, &input)) {
+            host_buttons = input.buttons;
+            if (movie_playing() || movie_recording()) continue;
+
+            offset = options.uncapped ? 0 : pacing_cycles_from_frame(input.time) + INPUT_LEAD_DOTS;
+            event.cycle = frame_start + (offset > 0 ? offset : 0);
+            event.buttons = input.buttons;
+            cpu_queue_input(&event);
+        }
+        apply_movie_frame(host_buttons);
+
+        // Update cpu logic
+        timeline_begin(TIMELINE_EMULATION, "run_frame");
+        gb_run_until_vblank();
+        timeline_end(TIMELINE_EMULATION, "run_frame");
+        movie_frame_done(ppu_get_pixel_buffer(), ppu_get_pixel_buffer_size());
+        if (options.counters) counters_update();
+
+        // Send the frame's audio to the output ring and the capture
+        timeline_begin(TIMELINE_EMULATION, "audio");
+        apu_end_frame(cpu_get_cycles());
+        samples = apu_read_samples(audio_buffer, APU_MAX_SAMPLES);
+        audio_push(audio_buffer, samples);
+        wav_capture_push(audio_buffer, samples);
+        timeline_end(TIMELINE_EMULATION, "audio");
+
+        // Publish the frame, only when it changed
+        if (ppu_get_redraw_flag()) {
+            timeline_begin(TIMELINE_EMULATION, "publish");
+            memcpy(triple_buffer_write_ptr(&frames), ppu_get_pixel_buffer(), ppu_get_pixel_buffer_size());
+            triple_buffer_publish(&frames, cpu_get_cycles());
+            ppu_set_redraw_flag(0);
+            timeline_end(TIMELINE_EMULATION, "publish");
+        }
+    }
     return 0;
 }
 
+// Button bound to a key, -1 for none
+int get_button(SDL_Scancode key) {
+    switch (key) {
+        case SDL_SCANCODE_RIGHT:    return BTN_RIGHT;
+        case SDL_SCANCODE_LEFT:     return BTN_LEFT;
+        case SDL_SCANCODE_UP:       return BTN_UP;
+        case SDL_SCANCODE_DOWN:     return BTN_DOWN;
+        case SDL_SCANCODE_X:        return BTN_A;
+        case SDL_SCANCODE_Z:        return BTN_B;
+        case SDL_SCANCODE_A:        return BTN_SELECT;
+        case SDL_SCANCODE_S:        return BTN_START;
+        default:                    return -1;
+    }
+}
+
+// Performance counter value of an SDL event timestamp (milliseconds since SDL_Init)
+u64 get_event_time(Uint32 timestamp) {
+    Uint32 age = SDL_GetTicks() - timestamp;
+    return SDL_GetPerformanceCounter() - (u64)age * SDL_GetPerformanceFrequency() / 1000;
+}
 
+// Headless: runs options.frames frames (or the whole movie) as fast as possible on the calling thread
+void run_headless() {
+
+    Uint64  start       = SDL_GetPerformanceCounter();
+    double  seconds;
+    u32     frame;
+
+    for (frame = 0; options.play_path ? movie_playing() : frame < options.frames; frame++) {
+        apply_movie_frame(0);
+        timeline_begin(TIMELINE_EMULATION, "run_frame");
+        gb_run_until_vblank();
+        timeline_end(TIMELINE_EMULATION, "run_frame");
+        movie_frame_done(ppu_get_pixel_buffer(), ppu_get_pixel_buffer_size());
+        apu_end_frame(cpu_get_cycles());
+        if (options.wav_path) {
+            wav_capture_push(audio_buffer, apu_read_samples(audio_buffer, APU_MAX_SAMPLES));
+        }
+    }
+
+    seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    printf("Headless: %u frames in %.3f s (%.1f fps)\n",
+        frame, seconds, seconds > 0.0 ? frame / seconds : 0.0);
+    if (options.counters) {
+        Counters totals;
+        counters_get(&totals);
+        counters_print(&totals, seconds);
+    }
+}
+
+// Render thread: polls events, forwards input to the emulation thread and presents the latest frame
 void application_update() {
     
-    u32   current_time      = 0;
-    u32   delta             = 0;
-    double timer_total       = 0; // Total game time
-    u32   last_frame_time   = SDL_GetTicks(); // Set to current time when difference is bigger than 1/60
     u8    keep_window_open  = 1;
+    u8    buttons           = 0;
+    int   button;
+    SDL_DisplayMode display_mode;
+
+    if (options.headless) {
+        run_headless();
+        return;
+    }
+
+    // Present at vsync, the emulation thread keeps its own pace
+    SDL_GL_SetSwapInterval(1);
+
+    pacing_init(DMG_FRAME_HZ);
+    if (pacing_mode == PACING_VSYNC && SDL_GetWindowDisplayMode(window, &display_mode) == 0) {
+        // A starting point, refined by measuring the swaps in application_draw
+        pacing_match_refresh(display_mode.refresh_rate);
+    }
+
+    SDL_AtomicSet(&emu_running, 1);
+    emu_thread = SDL_CreateThread(emulation_thread, "emulation", NULL);
+    if (emu_thread == NULL)
+    {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        return;
+    }
 
     while (keep_window_open) {
 
         // Poll events while queue isn't empty (uses a filter, see EventFilter function)
+        timeline_begin(TIMELINE_RENDER, "events");
         while (SDL_PollEvent(&window_event)) {
             switch (window_event.type) {
             case SDL_QUIT:
@@ -186,68 +451,98 @@ void application_update() {
             }
             break;
             case SDL_KEYDOWN:
-                //
-                break;
+            case SDL_KEYUP:
+            {
+                // F9 pauses and resumes the timeline
+                if (window_event.key.keysym.scancode == SDL_SCANCODE_F9) {
+                    if (window_event.type == SDL_KEYDOWN && !window_event.key.repeat) timeline_set_recording(!timeline_recording());
+                    break;
+                }
+                // F10 switches between PBO and direct uploads, printing the stats of the mode left
+                if (window_event.key.keysym.scancode == SDL_SCANCODE_F10) {
+                    if (window_event.type == SDL_KEYDOWN && !window_event.key.repeat) {
+                        graphics_print_frame_stats();
+                        graphics_set_upload_mode(graphics_get_upload_mode() == UPLOAD_PBO ? UPLOAD_DIRECT : UPLOAD_PBO);
+                    }
+                    break;
+                }
+
+                // Every change is sent with the time it happened, the emulation thread maps it to a cycle
+                button = get_button(window_event.key.keysym.scancode);
+                if (button < 0 || window_event.key.repeat) break;
+                if (window_event.type == SDL_KEYDOWN)   SET_BIT(buttons, button);
+                else                                    RESET_BIT(buttons, button);
+
+                HostInput input = { get_event_time(window_event.key.timestamp), buttons };
+                spsc_push(&input_queue, &input);
+            }
+            break;
             }
         }
-        // Array of pressed inputs, which is later passed to the emulator.
-        u8 inputs[8] = { 
-            kb_state[SDL_SCANCODE_RIGHT], 
-            kb_state[SDL_SCANCODE_LEFT], 
-            kb_state[SDL_SCANCODE_UP],
-            kb_state[SDL_SCANCODE_DOWN],
-            kb_state[SDL_SCANCODE_X],
-            kb_state[SDL_SCANCODE_Z],
-            kb_state[SDL_SCANCODE_A],
-            kb_state[SDL_SCANCODE_S]
-        };
+        timeline_end(TIMELINE_RENDER, "events");
 
-        // Stalls the program when its running too fast
-        current_time = SDL_GetTicks();
-        delta = current_time - last_frame_time;
-        if (delta > 100) delta = 100;
-        last_frame_time = current_time;
-
-        if (tick_rate > delta)
-        {
-            SDL_Delay((u32)(tick_rate - delta));
-            //printf("under: %d\n", (int)tick_rate - delta);
-        }
-        else
-        {
-            //printf("over: %d\n", delta - (int)tick_rate);
-        }
+        // Draw
+        application_draw();
+    }
 
-        ////////////////////////////////////////////
-        // This part of the code aims to execute at ~60 fps
+    SDL_AtomicSet(&emu_running, 0);
+    SDL_WaitThread(emu_thread, NULL);
+    emu_thread = NULL;
 
-        // Update frame logic
-        timer_total += tick_rate;
+    pacing_print_stats();
+}
 
-        // Update cpu logic
-        cpu_update((u8*) &inputs);
+// Measures the interval between swaps, which is the display refresh when swapping every vsync
+void measure_refresh()
+{
+    Uint64 now = SDL_GetPerformanceCounter();
 
-        // Draw
-        application_draw();
+    if (swap_prev != 0) {
+        double ms = (double)(now - swap_prev) * 1000.0 / SDL_GetPerformanceFrequency();
+        // Moving average, ignoring hitches
+        if (refresh_ms == 0.0) refresh_ms = ms;
+        else if (ms < refresh_ms * 1.5) refresh_ms += (ms - refresh_ms) * 0.05;
 
-        last_frame_time = current_time;
+        if (++swap_count % 60 == 0) pacing_match_refresh(1000.0 / refresh_ms);
     }
+    swap_prev = now;
 }
 
 void application_draw() {
-    if (!ppu_get_redraw_flag()) return; // Only draws when necessary
+    // Only uploads when the emulation thread published a new frame
+    if (triple_buffer_consume(&frames)) {
+        timeline_begin(TIMELINE_RENDER, "upload");
+        graphics_update_rgba_buffer(triple_buffer_read_ptr(&frames));
+        timeline_end(TIMELINE_RENDER, "upload");
+    }
+    else if (pacing_mode != PACING_VSYNC) {
+        timeline_begin(TIMELINE_RENDER, "sleep");
+        SDL_Delay(1);
+        timeline_end(TIMELINE_RENDER, "sleep");
+        return;
+    }
 
-    graphics_update_rgba_buffer(ppu_get_pixel_buffer());
+    // In PACING_VSYNC the swap blocks until the next vsync, which keeps measuring the refresh rate
+    timeline_begin(TIMELINE_RENDER, "present");
     graphics_draw(window);
-
-    ppu_set_redraw_flag(0);
+    timeline_end(TIMELINE_RENDER, "present");
+    if (pacing_mode == PACING_VSYNC) measure_refresh();
 }
 
 void application_cleanup() {
+    movie_stop();
+    if (options.trace_path && trace_count() > 0) trace_save(options.trace_path);
+    trace_stop();
+    if (options.profile_path) profiler_save(options.profile_path);
+    profiler_stop();
+    timeline_stop();
+    wav_capture_stop();
+    if (!options.headless) cleanup_video();
+    triple_buffer_cleanup(&frames);
+    spsc_cleanup(&input_queue);
     cpu_cleanup();
+    apu_cleanup();
     ppu_cleanup();
-    graphics_cleanup();
-    if (window) SDL_DestroyWindow(window);
     SDL_Quit();
 
 }
@@ -0,0 +1,501 @@
+#include "apu.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "blip.h"
+#include "emu_shared.h"
+
+#define APU_CLOCK_HZ        4194304
+#define SEQUENCER_PERIOD    8192                // DIV bit 4 (bit 5 in double speed) falls every 8192 dots (512 Hz)
+#define MAX_FRAME_CLOCKS    (2 * 70224)         // longest stretch between blip frames
+#define CHANNEL_GAIN        32                  // 4 channels * 15 * 8 (NR50) * 32 stays well within s16
+
+// Channel indices, also the bit of each channel in NR51/NR52
+enum ApuChannel {
+    CH_SQUARE1,
+    CH_SQUARE2,
+    CH_WAVE,
+    CH_NOISE
+};
+
+typedef struct Channel {
+    u8  enabled;        // reported in NR52
+    u8  dac_enabled;
+    u16 length;         // counts down to 0, disables the channel if length_enabled
+    u8  length_enabled;
+    u64 next_edge;      // dot at which the frequency timer expires next
+    u8  pos;            // duty step (square) / sample index (wave)
+    u8  volume;         // envelope volume (square/noise)
+    u8  env_timer;
+    u8  output;         // digital output, 0-15
+    s32 left;           // current contribution to each side
+    s32 right;
+} Channel;
+
+// Registers 0x10-0x2F as read back, unused bits read as 1
+const u8 read_masks[0x20] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,   // NR10-NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,   // (unused), NR21-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,   // NR30-NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,   // (unused), NR41-NR44
+    0x00, 0x00, 0x70,               // NR50-NR52
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+const u8 duty_table[4][8] = {
+    { 0, 0, 0, 0, 0, 0, 0, 1 }, // 12.5%
+    { 1, 0, 0, 0, 0, 0, 0, 1 }, // 25%
+    { 1, 0, 0, 0, 0, 1, 1, 1 }, // 50%
+    { 0, 1, 1, 1, 1, 1, 1, 0 }  // 75%
+};
+const u8 noise_divisors[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+
+Channel     ch[4];
+u16         sweep_shadow;   // channel 1 frequency the sweep works on
+u8          sweep_timer;
+u8          sweep_enabled;
+u16         lfsr;           // noise linear-feedback shift register
+
+u8          powered;
+u8          seq_step;       // frame sequencer step, 0-7
+u8          seq_speed;      // 1 in double speed, the sequencer then follows DIV bit 5
+u64         seq_next;       // dot of the next frame sequencer step
+u64         apu_time;       // dot the channels have been advanced to
+u64         frame_start;    // dot at which the current blip frame started
+
+BlipBuffer  blip_left;
+BlipBuffer  blip_right;
+int         output_rate;
+u8          synthesis = 1;  // 0: only the state visible through the registers is kept, no samples
+
+// FORWARD DECLARE
+void apu_run(u64 now);
+
+// PUBLIC --------------------------------------------------
+
+// Initialize
+int apu_init(int sample_rate)
+{
+    if (blip_init(&blip_left, APU_MAX_SAMPLES) == -1 || blip_init(&blip_right, APU_MAX_SAMPLES) == -1) {
+        return -1;
+    }
+    output_rate = sample_rate;
+    blip_set_rates(&blip_left, APU_CLOCK_HZ, sample_rate);
+    blip_set_rates(&blip_right, APU_CLOCK_HZ, sample_rate);
+    return 0;
+}
+
+// Syncs the internal state with the register values set on power up
+void apu_reset(u64 now)
+{
+    memset(ch, 0, sizeof(ch));
+    powered = GET_BIT(reg[REG_NR52], 7);
+    ch[CH_SQUARE1].enabled      = GET_BIT(reg[REG_NR52], 0);
+    ch[CH_SQUARE1].dac_enabled  = (reg[REG_NR12] & 0xF8) != 0;
+    ch[CH_SQUARE2].dac_enabled  = (reg[REG_NR22] & 0xF8) != 0;
+    ch[CH_WAVE].dac_enabled     = GET_BIT(reg[REG_NR30], 7);
+    ch[CH_NOISE].dac_enabled    = (reg[REG_NR42] & 0xF8) != 0;
+    lfsr = 0x7FFF;
+    sweep_enabled = 0;
+
+    seq_step = 0;
+    seq_speed = 0;
+    seq_next = now + SEQUENCER_PERIOD;
+    apu_time = now;
+    frame_start = now;
+    if (blip_left.buffer)   blip_clear(&blip_left);
+    if (blip_right.buffer)  blip_clear(&blip_right);
+}
+
+void apu_cleanup()
+{
+    blip_cleanup(&blip_left);
+    blip_cleanup(&blip_right);
+}
+
+// PRIVATE --------------------------------------------------
+
+u16 get_freq(u8 nrx3)
+{
+    return reg[nrx3] | ((reg[nrx3 + 1] & 0x7) << 8);
+}
+
+// Dots between two expiries of the channel's frequency timer
+u32 get_period(u8 i)
+{
+    switch (i) {
+        case CH_SQUARE1:    return (2048 - get_freq(REG_NR13)) * 4;
+        case CH_SQUARE2:    return (2048 - get_freq(REG_NR23)) * 4;
+        case CH_WAVE:       return (2048 - get_freq(REG_NR33)) * 2;
+        default:            return noise_divisors[reg[REG_NR43] & 0x7] << (reg[REG_NR43] >> 4);
+    }
+}
+
+// Recomputes the channel's output and adds the change to the buffers at the given dot
+void update_output(u8 i, u64 time)
+{
+    Channel*    c = &ch[i];
+    u8          out = 0;
+    s32         left, right;
+
+    if (!synthesis) return;
+    if (c->enabled && c->dac_enabled) {
+        switch (i) {
+            case CH_SQUARE1:
+            case CH_SQUARE2:
+                out = duty_table[reg[i == CH_SQUARE1 ? REG_NR11 : REG_NR21] >> 6][c->pos] ? c->volume : 0;
+                break;
+            case CH_WAVE:
+            {
+                u8 sample = reg[REG_WAVERAM + (c->pos >> 1)];
+                u8 code = (reg[REG_NR32] >> 5) & 0x3;
+                sample = (c->pos & 1) ? (sample & 0xF) : (sample >> 4);
+                out = code ? (sample >> (code - 1)) : 0;
+            } break;
+            case CH_NOISE:
+                out = (~lfsr & 1) ? c->volume : 0;
+                break;
+        }
+    }
+    c->output = out;
+
+    // NR51 bits 4-7 route to the left, 0-3 to the right. NR50 holds the volume of each side.
+    left  = GET_BIT(reg[REG_NR51], 4 + i) ? out * (((reg[REG_NR50] >> 4) & 0x7) + 1) * CHANNEL_GAIN : 0;
+    right = GET_BIT(reg[REG_NR51], i)     ? out * ((reg[REG_NR50] & 0x7) + 1) * CHANNEL_GAIN : 0;
+    if (left != c->left) {
+        blip_add_delta(&blip_left, (u32)(time - frame_start), left - c->left);
+        c->left = left;
+    }
+    if (right != c->right) {
+        blip_add_delta(&blip_right, (u32)(time - frame_start), right - c->right);
+        c->right = right;
+    }
+}
+
+// Advances a channel's frequency timer up to the given dot, producing a step at every output change
+void run_channel(u8 i, u64 end)
+{
+    Channel*    c = &ch[i];
+    u32         period;
+
+    if (!c->enabled) return;
+    period = get_period(i);
+    // Shifts of 14 and 15 don't clock the noise channel at all
+    if (i == CH_NOISE && (reg[REG_NR43] >> 4) >= 14) {
+        c->next_edge = end + period;
+        return;
+    }
+
+    while (c->next_edge <= end) {
+        switch (i) {
+            case CH_SQUARE1:
+            case CH_SQUARE2:
+                c->pos = (c->pos + 1) & 0x7;
+                break;
+            case CH_WAVE:
+                c->pos = (c->pos + 1) & 0x1F;
+                break;
+            case CH_NOISE:
+            {
+                u16 bit = (lfsr ^ (lfsr >> 1)) & 1;
+                lfsr = (lfsr >> 1) | (bit << 14);
+                // 7-bit mode
+                if (GET_BIT(reg[REG_NR43], 3)) lfsr = (lfsr & ~BIT_MASK(6)) | (bit << 6);
+            } break;
+        }
+        update_output(i, c->next_edge);
+        c->next_edge += period;
+    }
+}
+
+// Channel 1 frequency after one sweep iteration, disables the channel on overflow
+u16 sweep_calc()
+{
+    u16 delta = sweep_shadow >> (reg[REG_NR10] & 0x7);
+    u16 freq = GET_BIT(reg[REG_NR10], 3) ? (sweep_shadow - delta) : (sweep_shadow + delta);
+
+    if (freq > 2047) ch[CH_SQUARE1].enabled = 0;
+    return freq;
+}
+
+void clock_length()
+{
+    for (u8 i = 0; i < 4; i++) {
+        if (ch[i].length_enabled && ch[i].length > 0) {
+            if (--ch[i].length == 0) ch[i].enabled = 0;
+        }
+    }
+}
+
+void clock_sweep()
+{
+    u8 period = (reg[REG_NR10] >> 4) & 0x7;
+
+    if (sweep_timer > 1) {
+        sweep_timer--;
+        return;
+    }
+    sweep_timer = period ? period : 8;
+
+    if (sweep_enabled && period) {
+        u16 freq = sweep_calc();
+        if (freq <= 2047 && (reg[REG_NR10] & 0x7)) {
+            sweep_shadow = freq;
+            reg[REG_NR13] = freq & 0xFF;
+            reg[REG_NR14] = (reg[REG_NR14] & 0xF8) | (freq >> 8);
+            sweep_calc(); // overflow check with the new frequency
+        }
+    }
+}
+
+void clock_envelope()
+{
+    const u8 nrx2[4] = { REG_NR12, REG_NR22, 0, REG_NR42 };
+
+    for (u8 i = 0; i < 4; i++) {
+        u8 env = reg[nrx2[i]];
+        u8 period = env & 0x7;
+        if (i == CH_WAVE || period == 0) continue;
+
+        if (ch[i].env_timer == 0 || --ch[i].env_timer == 0) {
+            ch[i].env_timer = period;
+            if (GET_BIT(env, 3) && ch[i].volume < 15)   ch[i].volume++;
+            else if (!GET_BIT(env, 3) && ch[i].volume > 0) ch[i].volume--;
+        }
+    }
+}
+
+void step_sequencer(u64 time)
+{
+    if ((seq_step & 1) == 0)            clock_length();
+    if (seq_step == 2 || seq_step == 6) clock_sweep();
+    if (seq_step == 7)                  clock_envelope();
+    seq_step = (seq_step + 1) & 0x7;
+
+    for (u8 i = 0; i < 4; i++) update_output(i, time);
+}
+
+// Ends the current blip frame. Without a consumer, the oldest samples are dropped.
+void end_blip_frame()
+{
+    u32 clocks = (u32)(apu_time - frame_start);
+    int keep = APU_MAX_SAMPLES / 2;
+
+    blip_end_frame(&blip_left, clocks);
+    blip_end_frame(&blip_right, clocks);
+    frame_start = apu_time;
+
+    if (blip_left.avail > keep) {
+        blip_read_samples(&blip_left, NULL, blip_left.avail - keep, 1);
+        blip_read_samples(&blip_right, NULL, blip_right.avail - keep, 1);
+    }
+}
+
+// Catches the channels and the frame sequencer up to the given dot.
+// Without synthesis only the frame sequencer runs (lengths, sweep and envelopes).
+void apu_run(u64 now)
+{
+    u64 end;
+
+    while (apu_time < now) {
+        end = now;
+        if (powered && end > seq_next) end = seq_next;
+        if (synthesis && end - frame_start > MAX_FRAME_CLOCKS) end = frame_start + MAX_FRAME_CLOCKS;
+
+        if (powered && synthesis) {
+            for (u8 i = 0; i < 4; i++) run_channel(i, end);
+        }
+        apu_time = end;
+
+        if (!powered) {
+            // Stays in phase with DIV while off
+            if (seq_next <= apu_time) seq_next += ((apu_time - seq_next) / SEQUENCER_PERIOD + 1) * SEQUENCER_PERIOD;
+        }
+        else if (apu_time == seq_next) {
+            step_sequencer(apu_time);
+            seq_next += SEQUENCER_PERIOD;
+        }
+        if (synthesis && apu_time - frame_start >= MAX_FRAME_CLOCKS) end_blip_frame();
+    }
+}
+
+void trigger(u8 i, u64 now)
+{
+    Channel*    c = &ch[i];
+    const u8    nrx2[4] = { REG_NR12, REG_NR22, 0, REG_NR42 };
+
+    c->enabled = c->dac_enabled;
+    if (c->length == 0) c->length = (i == CH_WAVE) ? 256 : 64;
+    c->next_edge = now + get_period(i);
+
+    if (i == CH_WAVE) {
+        c->pos = 0;
+    }
+    else {
+        c->volume = reg[nrx2[i]] >> 4;
+        c->env_timer = reg[nrx2[i]] & 0x7;
+    }
+    if (i == CH_NOISE) {
+        lfsr = 0x7FFF;
+    }
+    if (i == CH_SQUARE1) {
+        u8 period = (reg[REG_NR10] >> 4) & 0x7;
+        sweep_shadow = get_freq(REG_NR13);
+        sweep_timer = period ? period : 8;
+        sweep_enabled = period || (reg[REG_NR10] & 0x7);
+        if (reg[REG_NR10] & 0x7) sweep_calc();
+    }
+}
+
+// PUBLIC --------------------------------------------------
+
+u8 apu_read(u8 addr, u64 now)
+{
+    u8 status;
+
+    if (addr >= REG_WAVERAM) return reg[addr];
+
+    apu_run(now);
+    if (addr == REG_NR52) {
+        status = (reg[REG_NR52] & 0x80) | read_masks[REG_NR52 - REG_NR10];
+        for (u8 i = 0; i < 4; i++) {
+            if (ch[i].enabled) SET_BIT(status, i);
+        }
+        return status;
+    }
+    return reg[addr] | read_masks[addr - REG_NR10];
+}
+
+void apu_write(u8 addr, u8 value, u64 now)
+{
+    apu_run(now);
+
+    if (addr >= REG_WAVERAM) {
+        reg[addr] = value;
+        update_output(CH_WAVE, now);
+        return;
+    }
+    if (addr == REG_NR52) {
+        if (powered && !GET_BIT(value, 7)) {
+            // Powering off clears all the registers
+            memset(&reg[REG_NR10], 0, REG_NR52 - REG_NR10);
+            for (u8 i = 0; i < 4; i++) {
+                ch[i].enabled = 0;
+                ch[i].dac_enabled = 0;
+                ch[i].length = 0;
+                ch[i].length_enabled = 0;
+                update_output(i, now);
+            }
+        }
+        else if (!powered && GET_BIT(value, 7)) {
+            seq_step = 0;
+        }
+        powered = GET_BIT(value, 7);
+        reg[REG_NR52] = value & 0x80;
+        return;
+    }
+    // Registers are read only while powered off
+    if (!powered) return;
+
+    reg[addr] = value;
+    switch (addr) {
+        case REG_NR11: ch[CH_SQUARE1].length = 64 - (value & 0x3F); break;
+        case REG_NR21: ch[CH_SQUARE2].length = 64 - (value & 0x3F); break;
+        case REG_NR31: ch[CH_WAVE].length = 256 - value; break;
+        case REG_NR41: ch[CH_NOISE].length = 64 - (value & 0x3F); break;
+
+        case REG_NR12:
+        case REG_NR22:
+        case REG_NR42:
+        {
+            // The DAC is off when the upper 5 bits are 0, which also disables the channel
+            u8 i = (addr == REG_NR12) ? CH_SQUARE1 : (addr == REG_NR22) ? CH_SQUARE2 : CH_NOISE;
+            ch[i].dac_enabled = (value & 0xF8) != 0;
+            if (!ch[i].dac_enabled) ch[i].enabled = 0;
+        } break;
+        case REG_NR30:
+            ch[CH_WAVE].dac_enabled = GET_BIT(value, 7);
+            if (!ch[CH_WAVE].dac_enabled) ch[CH_WAVE].enabled = 0;
+            break;
+
+        case REG_NR14:
+        case REG_NR24:
+        case REG_NR34:
+        case REG_NR44:
+        {
+            u8 i = (addr == REG_NR14) ? CH_SQUARE1 : (addr == REG_NR24) ? CH_SQUARE2 : (addr == REG_NR34) ? CH_WAVE : CH_NOISE;
+            ch[i].length_enabled = GET_BIT(value, 6);
+            if (GET_BIT(value, 7)) trigger(i, now);
+        } break;
+    }
+    // Any register can change what the channels output
+    for (u8 i = 0; i < 4; i++) update_output(i, now);
+}
+
+// Writing to DIV resets it, which clocks the frame sequencer if DIV bit 4 (5 in double speed) was set
+void apu_div_reset(u8 div, u64 now)
+{
+    apu_run(now);
+    if (powered && GET_BIT(div, 4 + seq_speed)) step_sequencer(now);
+    seq_next = now + SEQUENCER_PERIOD;
+}
+
+// Puts the frame sequencer in phase with the system counter (power up, speed switch).
+// Its bit falls every 8192 dots at either speed, but at a different point of the count.
+void apu_sync_div(u16 counter, u8 double_speed, u64 now)
+{
+    u16 mask = (SEQUENCER_PERIOD << double_speed) - 1;
+
+    apu_run(now);
+    seq_speed = double_speed;
+    seq_next = now + (((mask & ~counter) + 1) >> double_speed);
+}
+
+// Turns sample generation on or off. Off, the APU only keeps what the game can observe
+// (NR52 channel bits, length counters, sweep, register read-back) at almost no cost per frame.
+void apu_set_synthesis(u8 enabled, u64 now)
+{
+    apu_run(now);
+    if (enabled && !synthesis) {
+        // The frequency timers stood still, restart them from now
+        synthesis = 1;
+        frame_start = now;
+        blip_clear(&blip_left);
+        blip_clear(&blip_right);
+        for (u8 i = 0; i < 4; i++) {
+            ch[i].next_edge = now + get_period(i);
+            ch[i].left = 0;
+            ch[i].right = 0;
+            update_output(i, now);
+        }
+    }
+    synthesis = enabled;
+}
+
+// Scales the output sample rate (dynamic rate control), takes effect from the next frame
+void apu_set_rate_adjust(double ratio)
+{
+    blip_set_rates(&blip_left, APU_CLOCK_HZ, output_rate * ratio);
+    blip_set_rates(&blip_right, APU_CLOCK_HZ, output_rate * ratio);
+}
+
+// Makes the samples up to the given dot available
+void apu_end_frame(u64 now)
+{
+    apu_run(now);
+    if (synthesis) end_blip_frame();
+}
+
+// Stereo sample pairs ready to be read
+int apu_samples_avail()
+{
+    return blip_left.avail;
+}
+
+// Reads up to count stereo sample pairs (left, right interleaved), returns the amount read
+int apu_read_samples(s16* out, int count)
+{
+    count = blip_read_samples(&blip_left, out, count, 2);
+    blip_read_samples(&blip_right, out + 1, count, 2);
+    return count;
+}
@@ -0,0 +1,139 @@
+#include "audio.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "apu.h"
+#include "spsc_queue.h"
+
+SDL_AudioDeviceID   audio_device = 0;
+SPSCQueue           audio_ring;     // stereo sample pairs (2 * s16)
+SDL_atomic_t        underruns;
+u32                 overruns;
+double              rate_ratio = 1.0;
+u8                  rate_control = 1;
+s16                 last_frame[2];  // repeated on underruns, avoids a click to 0
+
+// Runs on the SDL audio thread
+void audio_callback(void* userdata, Uint8* stream, int len)
+{
+    s16*    out     = (s16*)stream;
+    u32     count   = len / (2 * sizeof(s16));
+    u32     got     = spsc_pop_n(&audio_ring, out, count);
+
+    if (got > 0) {
+        last_frame[0] = out[(got - 1) * 2];
+        last_frame[1] = out[(got - 1) * 2 + 1];
+    }
+    if (got < count) {
+        SDL_AtomicAdd(&underruns, 1);
+        for (u32 i = got; i < count; i++) {
+            out[i * 2]      = last_frame[0];
+            out[i * 2 + 1]  = last_frame[1];
+        }
+    }
+}
+
+// Initialize, returns -1 when no audio device is available (emulation can go on without it)
+int audio_init(int sample_rate)
+{
+    SDL_AudioSpec want, have;
+
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
+    {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        return -1;
+    }
+    if (spsc_init(&audio_ring, 2 * sizeof(s16), AUDIO_RING_FRAMES) == -1)
+    {
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        return -1;
+    }
+
+    SDL_zero(want);
+    want.freq       = sample_rate;
+    want.format     = AUDIO_S16SYS;
+    want.channels   = 2;
+    want.samples    = 512;
+    want.callback   = audio_callback;
+
+    audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if (audio_device == 0)
+    {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        spsc_cleanup(&audio_ring);
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        return -1;
+    }
+
+    SDL_AtomicSet(&underruns, 0);
+    overruns = 0;
+    rate_ratio = 1.0;
+    SDL_PauseAudioDevice(audio_device, 0);
+    return 0;
+}
+
+void audio_cleanup()
+{
+    if (audio_device == 0) return;
+
+    audio_print_stats();
+    SDL_CloseAudioDevice(audio_device);
+    audio_device = 0;
+    spsc_cleanup(&audio_ring);
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+}
+
+// Emulation thread. Queues stereo sample pairs and steers the APU output rate so the
+// ring stays around AUDIO_TARGET_FRAMES, which locks the audio clock to the video pacing.
+void audio_push(const s16* samples, int count)
+{
+    u32     free_frames, fill;
+    double  error;
+
+    if (audio_device == 0) return;
+
+    free_frames = spsc_free(&audio_ring);
+    if ((u32)count > free_frames) {
+        overruns++;
+        count = free_frames;
+    }
+    spsc_push_n(&audio_ring, samples, count);
+
+    if (!rate_control) return;
+
+    // Fuller than the target: produce fewer samples, emptier: produce more
+    fill = spsc_count(&audio_ring);
+    error = ((double)fill - AUDIO_TARGET_FRAMES) / AUDIO_TARGET_FRAMES;
+    if (error > 1.0) error = 1.0;
+    if (error < -1.0) error = -1.0;
+    rate_ratio = 1.0 - error * AUDIO_MAX_ADJUST;
+    apu_set_rate_adjust(rate_ratio);
+}
+
+// Off, the APU keeps its nominal rate and the output absorbs the drift with under/overruns.
+// Needed when the stream must not depend on host timing (captures).
+void audio_set_rate_control(u8 enabled)
+{
+    rate_control = enabled;
+    rate_ratio = 1.0;
+    apu_set_rate_adjust(rate_ratio);
+}
+
+void audio_get_stats(AudioStats* stats)
+{
+    stats->underruns    = SDL_AtomicGet(&underruns);
+    stats->overruns     = overruns;
+    stats->fill         = (audio_device != 0) ? spsc_count(&audio_ring) : 0;
+    stats->ratio        = rate_ratio;
+}
+
+void audio_print_stats()
+{
+    AudioStats stats;
+
+    audio_get_stats(&stats);
+    printf("Audio: %u underruns, %u overruns, %u queued, rate %.4f\n",
+        stats.underruns, stats.overruns, stats.fill, stats.ratio);
+}
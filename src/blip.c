@@ -0,0 +1,162 @@
+#include "blip.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define BLIP_PHASES         (1 << BLIP_PHASE_BITS)
+#define BLIP_WIDTH          (BLIP_HALF_WIDTH * 2)
+#define BLIP_FRAC_BITS      32
+#define BLIP_HIGH_PASS      9   // DC blocker, roughly 15 Hz at 48 kHz
+#define PI                  3.14159265358979323846
+
+// Difference of a band-limited step for each sub-sample phase, shared by all buffers
+s16 blip_kernel[BLIP_PHASES][BLIP_WIDTH];
+u8  blip_kernel_ready = 0;
+
+// Band-limited (Blackman windowed sinc) step response at x samples from the step
+double blip_step(double x)
+{
+    const int   steps = 64; // integration steps per sample
+    double      sum = 0.0;
+    double      t, w, sinc;
+
+    if (x <= -BLIP_HALF_WIDTH) return 0.0;
+    if (x >= BLIP_HALF_WIDTH) return 1.0;
+
+    // Integrate the impulse from the start of the window up to x
+    for (int i = 0; i < (x + BLIP_HALF_WIDTH) * steps; i++) {
+        t = -BLIP_HALF_WIDTH + (i + 0.5) / steps;
+        sinc = (t == 0.0) ? 1.0 : sin(PI * t * 0.9) / (PI * t * 0.9); // cutoff slightly below nyquist
+        w = 0.42 + 0.5 * cos(PI * t / BLIP_HALF_WIDTH) + 0.08 * cos(2.0 * PI * t / BLIP_HALF_WIDTH);
+        sum += sinc * w * 0.9 / steps;
+    }
+    return sum;
+}
+
+void init_kernel()
+{
+    double  step_prev, step, norm;
+    int     sum, center;
+
+    for (int p = 0; p < BLIP_PHASES; p++) {
+        double frac = (double)p / BLIP_PHASES;
+        // Normalize so every phase adds exactly a full step, otherwise DC would drift
+        norm = blip_step(BLIP_HALF_WIDTH - frac) - blip_step(-BLIP_HALF_WIDTH - frac);
+        step_prev = blip_step(-BLIP_HALF_WIDTH + 1 - frac - 1);
+        sum = 0;
+        for (int i = 0; i < BLIP_WIDTH; i++) {
+            step = blip_step(-BLIP_HALF_WIDTH + 1 + i - frac);
+            blip_kernel[p][i] = (s16)floor((step - step_prev) / norm * (1 << BLIP_KERNEL_BITS) + 0.5);
+            sum += blip_kernel[p][i];
+            step_prev = step;
+        }
+        // Put the rounding error in the largest tap
+        center = BLIP_HALF_WIDTH - 1 + (frac >= 0.5);
+        blip_kernel[p][center] += (1 << BLIP_KERNEL_BITS) - sum;
+    }
+    blip_kernel_ready = 1;
+}
+
+int blip_init(BlipBuffer* b, int capacity)
+{
+    if (!blip_kernel_ready) init_kernel();
+
+    b->buffer = (s32*)calloc(capacity + BLIP_WIDTH, sizeof(s32));
+    if (b->buffer == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the blip buffer!\n");
+        return -1;
+    }
+    b->capacity = capacity;
+    b->factor = 0;
+    blip_clear(b);
+    return 0;
+}
+
+void blip_cleanup(BlipBuffer* b)
+{
+    if (b->buffer) free(b->buffer);
+    b->buffer = NULL;
+}
+
+void blip_set_rates(BlipBuffer* b, double clock_rate, double sample_rate)
+{
+    b->factor = (u64)(sample_rate / clock_rate * 4294967296.0 + 0.5);
+}
+
+void blip_clear(BlipBuffer* b)
+{
+    b->avail = 0;
+    b->offset = 0;
+    b->integrator = 0;
+    b->high_pass = 0;
+    if (b->buffer) memset(b->buffer, 0, (b->capacity + BLIP_WIDTH) * sizeof(s32));
+}
+
+// Adds an amplitude change at the given clock, relative to the start of the current frame
+void blip_add_delta(BlipBuffer* b, u32 time, int delta)
+{
+    u64     pos     = time * b->factor + b->offset;
+    int     index   = b->avail + (int)(pos >> BLIP_FRAC_BITS);
+    int     phase   = (int)(pos >> (BLIP_FRAC_BITS - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1);
+    s32*    out;
+    s16*    kernel;
+
+    if (delta == 0) return;
+    if (index > b->capacity) return; // frame is too long for the buffer, the caller should end frames sooner
+
+    out = b->buffer + index;
+    kernel = blip_kernel[phase];
+    for (int i = 0; i < BLIP_WIDTH; i++) {
+        out[i] += kernel[i] * delta;
+    }
+}
+
+// Makes the samples up to the given clock available for reading
+void blip_end_frame(BlipBuffer* b, u32 clocks)
+{
+    u64 pos = clocks * b->factor + b->offset;
+
+    b->avail += (int)(pos >> BLIP_FRAC_BITS);
+    b->offset = pos & 0xFFFFFFFFULL;
+    if (b->avail > b->capacity) b->avail = b->capacity;
+}
+
+// Clocks needed for the given amount of samples to become available
+int blip_clocks_needed(BlipBuffer* b, int samples)
+{
+    u64 needed = ((u64)(samples - b->avail) << BLIP_FRAC_BITS) - b->offset;
+
+    if (samples <= b->avail) return 0;
+    return (int)((needed + b->factor - 1) / b->factor);
+}
+
+// Integrates up to count samples into out (every stride'th s16), returns the amount read.
+// out can be NULL to discard samples.
+int blip_read_samples(BlipBuffer* b, s16* out, int count, int stride)
+{
+    s32 sum = b->integrator;
+    s32 hp  = b->high_pass;
+    s32 s;
+
+    if (count > b->avail) count = b->avail;
+
+    for (int i = 0; i < count; i++) {
+        sum += b->buffer[i];
+        s = (sum - hp) >> BLIP_KERNEL_BITS;
+        hp += (sum - hp) >> BLIP_HIGH_PASS;
+        if (s > 32767) s = 32767;
+        if (s < -32768) s = -32768;
+        if (out) out[i * stride] = (s16)s;
+    }
+    b->integrator = sum;
+    b->high_pass = hp;
+
+    // Move the remaining deltas (including the tail of the last steps) to the start
+    memmove(b->buffer, b->buffer + count, (b->capacity + BLIP_WIDTH - count) * sizeof(s32));
+    memset(b->buffer + b->capacity + BLIP_WIDTH - count, 0, count * sizeof(s32));
+    b->avail -= count;
+    return count;
+}
@@ -0,0 +1,109 @@
+#include "counters.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+
+#ifdef ALU_COUNTERS
+Counters counters;
+
+const u8 counter_region_lut[0x10] = {
+    REGION_ROM0, REGION_ROM0, REGION_ROM0, REGION_ROM0,
+    REGION_ROMN, REGION_ROMN, REGION_ROMN, REGION_ROMN,
+    REGION_VRAM, REGION_VRAM, REGION_ERAM, REGION_ERAM,
+    REGION_WRAM, REGION_WRAM, REGION_WRAM, REGION_WRAM
+};
+#endif
+
+const char* region_names[REGION_COUNT] = { "ROM0", "ROMn", "VRAM", "ERAM", "WRAM", "OAM", "IO", "HRAM" };
+const char* interrupt_names[5] = { "vblank", "stat", "timer", "serial", "joypad" };
+
+// Snapshot of the last dump, counters_update prints the difference
+Counters    last_dump;
+u64         last_dump_time;
+
+u8 counters_enabled()
+{
+#ifdef ALU_COUNTERS
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void counters_get(Counters* out)
+{
+#ifdef ALU_COUNTERS
+    *out = counters;
+#else
+    memset(out, 0, sizeof(Counters));
+#endif
+}
+
+void counters_reset()
+{
+#ifdef ALU_COUNTERS
+    memset(&counters, 0, sizeof(Counters));
+#endif
+    memset(&last_dump, 0, sizeof(Counters));
+    last_dump_time = 0;
+}
+
+// Prints counts as rates over the given time, opcodes only the ten most executed
+void counters_print(const Counters* c, double seconds)
+{
+    u64 total = 0;
+    u8  top[10];
+    u8  top_count = 0;
+
+    if (seconds <= 0.0) seconds = 1.0;
+    for (u32 i = 0; i < 0x100; i++) total += c->opcodes[i];
+
+    // Insertion into a short sorted list, 256 entries do not need more
+    for (u32 i = 0; i < 0x100; i++) {
+        u8 pos = top_count;
+        if (c->opcodes[i] == 0) continue;
+        while (pos > 0 && c->opcodes[top[pos - 1]] < c->opcodes[i]) pos--;
+        if (pos >= 10) continue;
+        if (top_count < 10) top_count++;
+        memmove(&top[pos + 1], &top[pos], top_count - pos - 1);
+        top[pos] = (u8)i;
+    }
+
+    printf("Instructions: %.0f/s, top:", total / seconds);
+    for (u8 i = 0; i < top_count; i++) printf(" %02X(%.1f%%)", top[i], 100.0 * c->opcodes[top[i]] / total);
+    printf("\nReads/s: ");
+    for (u8 i = 0; i < REGION_COUNT; i++) printf(" %s %.0f", region_names[i], c->reads[i] / seconds);
+    printf("\nWrites/s:");
+    for (u8 i = 0; i < REGION_COUNT; i++) printf(" %s %.0f", region_names[i], c->writes[i] / seconds);
+    printf("\nInterrupts/s:");
+    for (u8 i = 0; i < 5; i++) printf(" %s %.0f", interrupt_names[i], c->interrupts[i] / seconds);
+    printf("\nBank switches/s: ROM %.0f, ERAM %.0f, halted cycles/s: %.0f, DMA/s: %.0f\n",
+        c->rom_bank_switches / seconds, c->eram_bank_switches / seconds, c->halt_cycles / seconds, c->dma_transfers / seconds);
+}
+
+// Call once per frame, prints what changed over the last second
+void counters_update()
+{
+#ifdef ALU_COUNTERS
+    u64         now = SDL_GetPerformanceCounter();
+    u64         freq = SDL_GetPerformanceFrequency();
+    Counters    delta;
+    u64*        d = (u64*)&delta;
+    const u64*  cur = (const u64*)&counters;
+    const u64*  prev = (const u64*)&last_dump;
+
+    if (last_dump_time == 0) {
+        last_dump = counters;
+        last_dump_time = now;
+        return;
+    }
+    if (now - last_dump_time < freq) return;
+
+    // Counters only holds u64 fields
+    for (u32 i = 0; i < sizeof(Counters) / sizeof(u64); i++) d[i] = cur[i] - prev[i];
+    counters_print(&delta, (double)(now - last_dump_time) / freq);
+    last_dump = counters;
+    last_dump_time = now;
+#endif
+}
@@ -13,6 +13,11 @@
 #include "macros.h"
 
 #include "ppu.h"
+#include "apu.h"
+#include "timer.h"
+#include "counters.h"
+#include "trace.h"
+#include "profiler.h"
 
 // Determines how many CPU cycles each instruction takes to perform
 u8 op_cycles_lut[]  = {
@@ -52,17 +57,22 @@ u8 boot_rom[]       = {
     0x21, 0x04, 0x01, 0x11, 0xA8, 0x00, 0x1A, 0x13, 0xBE, 0x20, 0xFE, 0x23, 0x7D, 0xFE, 0x34, 0x20,
     0xF5, 0x06, 0x19, 0x78, 0x86, 0x23, 0x05, 0x20, 0xFB, 0x86, 0x20, 0xFE, 0x3E, 0x01, 0xE0, 0x50
 };
-// Last input retrieved
-u8 inputs[8];
+// Current input, active low
 u8 inputs_direction;
 u8 inputs_action;
 
+// Pending input changes, sorted by cycle
+#define INPUT_EVENTS_MAX 64
+InputEvent input_events[INPUT_EVENTS_MAX];
+u8 input_event_count;
+
 // Define shared memory between the CPU and PPU
 u8  reg[0x100];     // Refers to Register enum
 u8  vram[2 * BANKSIZE_VRAM];
 u8  oam[0xA0];
 u8  cpu_mode;       // vblank/hblank/oam search/pixel rendering...
 u8  interrupts_enabled; // IME flag
+u8  vblank_reached; // set by the PPU when LY reaches 144
 
 // Hardware registers
 u8  A;              // Accumulator
@@ -86,15 +96,30 @@ u16 rom_banks;      // up to 512 banks of 16 KB each (8MB)
 u8  eram_banks;     // up to 16 banks of 8 KB each (128 KB)
 
 // Hardware timers
+u64 cycles_total;   // master clock, dots since power up
+u64 instructions_total; // executed since power up, halted cycles excluded
 u8  double_speed;
-u16 div_counter;    // every >256, DIV++
-u8  timer_enabled;  // bit  2   of reg TAC
-u16 timer_speed;    // bits 0-1 of reg TAC
-u16 timer_counter;  // every >timer_speed, TIMA++
+u8  tick_dots = 4;   // dots per M-cycle, 2 in double speed
+
+// Scheduled events, run by tick() once the master clock reaches them
+enum Event {
+    EVENT_TIMER,    // TIMA overflow
+    EVENT_INPUT,    // next pending input change
+    EVENT_PROFILE,  // next profiler sample
+    EVENT_DMA,      // end of the running OAM DMA transfer
+    EVENT_COUNT
+};
+u64 event_time[EVENT_COUNT];
+u64 next_event = CYCLES_NEVER;   // earliest of event_time
+u32 sample_interval;    // dots between profiler samples, 0 when not profiling
 
 u8  halted;
 u8  dma_transfer_flag; // whether a dma transfer is currently running
-u8  dma_index;      // 0x00-0x9F
+u64 dma_start;      // dot the running transfer started at
+u8  hdma_active;    // HBlank VRAM DMA running, reg[REG_HDMA5] holds the blocks left - 1
+u16 hdma_source;
+u16 hdma_dest;      // offset into the VRAM bank
+u16 stall_cycles;   // M-cycles the CPU is held for (VRAM DMA, speed switch)
 
 // Header information
 unsigned char title[17]; // 16 + '\0'
@@ -129,7 +154,12 @@ u8 test_finished = 0;
 // Forward declarations
 void tick();
 void update_inputs();
-void update_timers(u8 cycles);
+void schedule_event(u8 event, u64 time);
+void switch_speed();
+void oam_dma_start(u8 page);
+void vram_dma_write(u8 value);
+u8 oam_dma_conflict(u16 addr);
+u8 oam_dma_position();
 u8 do_interrupts();
 
 // Arithmetic
@@ -311,28 +341,42 @@ u8 interrupt_is_pending() {
 
 int power_up()
 {
-    // Reset registers to their default values (DMG)
-    A = 0x01;
-    F_Z = 1;
-    F_N = 0;
-    if (checksum_header == 0)
-    {
+    // Reset registers to their default values. A = 0x11 is how games tell a CGB apart.
+    if (cgb_flag) {
+        A = 0x11;
+        F_Z = 1;
+        F_N = 0;
         F_H = 0;
         F_C = 0;
+        BC.full = 0x0000;
+        DE.full = 0xFF56;
+        HL.full = 0x000D;
     }
     else {
-        F_H = 1;
-        F_C = 1;
+        A = 0x01;
+        F_Z = 1;
+        F_N = 0;
+        if (checksum_header == 0)
+        {
+            F_H = 0;
+            F_C = 0;
+        }
+        else {
+            F_H = 1;
+            F_C = 1;
+        }
+        BC.full = 0x0013;
+        DE.full = 0x00D8;
+        HL.full = 0x014D;
     }
-
-    BC.full = 0x0013;
-    DE.full = 0x00D8;
-    HL.full = 0x014D;
     SP.full = 0xFFFE;
     PC = 0x0100;
 
     interrupts_enabled = 0;
     halted = 0;
+    stall_cycles = 0;
+    hdma_active = 0;
+    dma_transfer_flag = 0;
 
     mbc_mode = 0;
     rom_bank = 1;
@@ -340,14 +384,15 @@ int power_up()
     eram_enabled = 0;
 
     reg[REG_P1] = 0xCF;
+    inputs_direction = 0xF; // nothing pressed
+    inputs_action = 0xF;
+    input_event_count = 0;
     reg[REG_SB] = 0x00;
     reg[REG_SC] = 0x7E;
     reg[REG_DIV] = 0xAB;
     reg[REG_TIMA] = 0x00;
     reg[REG_TMA] = 0x00;
     reg[REG_TAC] = 0xF8;
-    timer_speed = 256;
-    timer_enabled = 0;
 
     reg[REG_IF] = 0xE1;
 
@@ -392,7 +437,7 @@ int power_up()
     reg[REG_WY] = 0x00;
     reg[REG_WX] = 0x00;
 
-    reg[REG_KEY1] = 0xFF;
+    reg[REG_KEY1] = cgb_flag ? 0x7E : 0xFF;
 
     reg[REG_VBK] = 0x00;
     reg[REG_HDMA1] = 0xFF;
@@ -411,6 +456,14 @@ int power_up()
     reg[REG_SVBK] = 0x00;
 
     reg[REG_IE] = 0x00;
+
+    double_speed = 0;
+    tick_dots = 4;
+    apu_reset(cycles_total);
+    timer_reset(cycles_total);
+    apu_sync_div(timer_counter(cycles_total), 0, cycles_total);
+    for (u8 i = 0; i < EVENT_COUNT; i++) event_time[i] = CYCLES_NEVER;
+    schedule_event(EVENT_TIMER, timer_next_overflow());
     return 0;
 }
 
@@ -436,7 +489,7 @@ int cpu_init(u8* rom_buffer)
     printf("Title: %s\n", title);
 
     // CGB Indicator
-    cgb_flag = rom[ROM_CGB_FLAG] == 0x80;
+    cgb_flag = GET_BIT(rom[ROM_CGB_FLAG], 7); // 0x80: CGB enhanced, 0xC0: CGB only
     printf("CGB: %s\n", cgb_flag ? "true" : "false");
 
     // SGB Indicator
@@ -509,11 +562,22 @@ int cpu_init(u8* rom_buffer)
     return 0;
 }
 
+// Offset of the WRAM bank mapped at D000-DFFF. SVBK selects banks 1-7 with its low 3 bits, 0 selects 1.
+u32 wram_bank_offset()
+{
+    u8 bank = cgb_flag ? (reg[REG_SVBK] & 0x7) : 1;
+    return (bank ? bank : 1) * BANKSIZE_WRAM;
+}
+
 u8 read(u16 addr)
 {
     // TODO - I/O register reading rules
 
     u8 msb = (u8)(addr >> 12);
+    COUNT_READ(addr);
+    if (dma_transfer_flag && addr < MEM_IO && oam_dma_conflict(addr)) {
+        return (addr >= MEM_OAM) ? 0xFF : oam[oam_dma_position()];
+    }
     switch (msb) {
         case 0x0:
         case 0x1:
@@ -563,16 +627,19 @@ u8 read(u16 addr)
         case 0xD:
         case 0xF:
             // WRAM Bank / ECHO RAM
-            if (addr < MEM_OAM) {
-                if (cgb_flag)   return wram[(addr & 0x1FFF) + (reg[REG_SVBK] * BANKSIZE_WRAM)];
-                else            return wram[addr & 0x1FFF];
-            }
+            if (addr < MEM_OAM) return wram[(addr & 0xFFF) + wram_bank_offset()];
             // Object attribute memory (OAM)
             else if (addr >= MEM_OAM && addr < MEM_UNUSABLE) {
                 return oam[addr - MEM_OAM]; // Convert to range 0-159
             }
             // I/O Registers
             else if (addr >= MEM_IO && addr < MEM_HRAM) {
+                // Audio registers and wave RAM
+                if (addr >= IO_AUDIO && addr < IO_LCD) return apu_read(addr & 0xFF, cycles_total);
+                // Timer and divider
+                if (addr >= IO_TIMER_DIV && addr < IO_TIMER_DIV + 4) return timer_read(addr & 0xFF, cycles_total);
+                // CGB palette data
+                if (cgb_flag && (addr == MEM_IO + REG_BGPD || addr == MEM_IO + REG_OBPD)) return ppu_read_palette(addr == MEM_IO + REG_OBPD);
                 return reg[addr - MEM_IO];   // Convert to range 0-255
             }
             // High RAM
@@ -591,9 +658,16 @@ int write(u16 addr, u8 value)
 {
     // TODO - I/O register writing rules
 
-    u8 msb = (u8)(addr >> 12);
+    u8  msb = (u8)(addr >> 12);
+    int result = 0;
+
+    COUNT_WRITE(addr);
     // MBC Registers
     if (msb < 0x8) {
+#ifdef ALU_COUNTERS
+        u16 prev_rom_bank = rom_bank;
+        u8  prev_eram_bank = eram_bank;
+#endif
         switch (mbc) {
             case 1:
             {
@@ -761,6 +835,7 @@ int write(u16 addr, u8 value)
                 }
             } break;
         }
+        COUNT_BANK_SWITCH(rom_bank != prev_rom_bank, eram_bank != prev_eram_bank);
     }
     else {
         switch (msb) {
@@ -773,10 +848,17 @@ int write(u16 addr, u8 value)
             case 0xA:
             case 0xB:
                 // ERAM
-                if (!eram_enabled) return -1;
+                // Ignored writes still take their M-cycle, so they only break out
+                if (!eram_enabled) {
+                    result = -1;
+                    break;
+                }
                 if (mbc == 2) {
                     // Half bytes, Bottom 9 bits of address are used to index RAM
-                    if (eram_bank >= eram_banks) return 0xFF;
+                    if (eram_bank >= eram_banks) {
+                        result = 0xFF;
+                        break;
+                    }
                     eram[addr & 0x1FF] = (value & 0xF);
                 }
                 else if (mbc == 3 && rtc_select_reg > 0) {
@@ -785,7 +867,10 @@ int write(u16 addr, u8 value)
                 }
                 else {
                     // "& 0x1FF" extracts the lower 13 bits, which maps the address to the array range starting from 0x0
-                    if (eram_bank >= eram_banks) return -1;
+                    if (eram_bank >= eram_banks) {
+                        result = -1;
+                        break;
+                    }
                     eram[(addr & 0x1FFF) + (eram_bank * BANKSIZE_ERAM)] = value;
                 }
                 break;
@@ -797,34 +882,27 @@ int write(u16 addr, u8 value)
             case 0xD:
             case 0xF:
                 // WRAM Bank / ECHO RAM
-                if (addr < MEM_OAM) {
-                    if (cgb_flag)   wram[(addr & 0x1FFF) + (reg[REG_SVBK] * BANKSIZE_WRAM)] = value;
-                    else            wram[addr & 0x1FFF] = value;
-                }
+                if (addr < MEM_OAM) wram[(addr & 0xFFF) + wram_bank_offset()] = value;
                 // Object attribute memory (OAM)
                 else if (addr >= MEM_OAM && addr < MEM_UNUSABLE) {
-                    oam[addr - MEM_OAM] = value; // Convert to range 0-159
+                    if (!dma_transfer_flag) oam[addr - MEM_OAM] = value; // Convert to range 0-159
                 }
                 // I/O Registers
                 else if (addr >= MEM_IO && addr < MEM_HRAM) {
                     switch (addr & 0xFF) {
                         case REG_P1:
-                            reg[addr & 0xFF] = value;
+                            // Only the select bits are writable
+                            reg[REG_P1] = (reg[REG_P1] & 0xCF) | (value & 0x30);
+                            update_inputs();
                             break;
                         case REG_DIV:
-                            reg[REG_DIV] = 0;
-                            break;
+                            apu_div_reset(timer_read(REG_DIV, cycles_total), cycles_total);
+                            // fall through
+                        case REG_TIMA:
+                        case REG_TMA:
                         case REG_TAC:
-                            // bit 01: Select at which frequency TIMA increases
-                            switch (value & 0x3) {
-                                case 0: timer_speed = 1024; break;
-                                case 1: timer_speed = 16; break;
-                                case 2: timer_speed = 64; break;
-                                case 3: timer_speed = 256; break;
-                            }
-                            // bit 2: Enable timer
-                            timer_enabled = GET_BIT(value, 2);
-                            reg[addr & 0xFF] = value;
+                            timer_write(addr & 0xFF, value, cycles_total);
+                            schedule_event(EVENT_TIMER, timer_next_overflow());
                             break;
                         case REG_IF:
                             // DEBUG
@@ -854,11 +932,25 @@ int write(u16 addr, u8 value)
                             // Source:      $XX00-$XX9F   ;XX = $00 to $DF
                             // Destination: $FE00-$FE9F
                             reg[REG_DMA] = value;
-                            dma_transfer_flag = 1;
+                            oam_dma_start(value);
+                            COUNT_DMA();
+                            break;
+                        case REG_KEY1:
+                            // Only the switch armed bit is writable, STOP does the switch
+                            if (cgb_flag) reg[REG_KEY1] = (reg[REG_KEY1] & 0x80) | 0x7E | (value & 1);
+                            break;
+                        case REG_HDMA5:
+                            if (cgb_flag) vram_dma_write(value);
+                            break;
+                        case REG_BGPD:
+                        case REG_OBPD:
+                            if (cgb_flag) ppu_write_palette((addr & 0xFF) == REG_OBPD, value);
                             break;
 
                         default:
-                            reg[addr & 0xFF] = value;   // Convert to range 0-255
+                            // Audio registers and wave RAM
+                            if (addr >= IO_AUDIO && addr < IO_LCD) apu_write(addr & 0xFF, value, cycles_total);
+                            else reg[addr & 0xFF] = value;   // Convert to range 0-255
                             break;
                     }
                     
@@ -892,7 +984,7 @@ int write(u16 addr, u8 value)
         }
     }
     tick(); // advance the clock 1 M-cycle
-    return 0;
+    return result;
 }
 
 u8 execute_cb(u8 op) {
@@ -1737,11 +1829,173 @@ u8 execute_cb(u8 op) {
     return cycles;
 }
 
+void schedule_event(u8 event, u64 time)
+{
+    event_time[event] = time;
+    next_event = CYCLES_NEVER;
+    for (u8 i = 0; i < EVENT_COUNT; i++) {
+        if (event_time[i] < next_event) next_event = event_time[i];
+    }
+}
+
+// OAM DMA copies 160 bytes in 160 M-cycles. The copy is done up front and the transfer
+// is then only a window in which the CPU sees bus conflicts, ended by EVENT_DMA.
+void oam_dma_start(u8 page)
+{
+    u16 source = (page >= 0xE0 ? page - 0x20 : page) << 8; // E0-FF read the WRAM echo
+
+    dma_transfer_flag = 0;
+    for (u8 i = 0; i < 0xA0; i++) oam[i] = read(source + i);
+    dma_transfer_flag = 1;
+    dma_start = cycles_total;
+    schedule_event(EVENT_DMA, cycles_total + 0xA0 * tick_dots);
+}
+
+// Whether a read collides with the running transfer. OAM is blocked and the bus the
+// transfer reads from (VRAM or the external bus) returns the byte being copied.
+u8 oam_dma_conflict(u16 addr)
+{
+    u8 vram_source = (reg[REG_DMA] >> 5) == 0x4;
+
+    if (addr >= MEM_OAM) return 1;
+    return ((addr >> 13) == 0x4) == vram_source;
+}
+
+// Host memory behind a 16 byte aligned VRAM DMA source block, NULL where reads have
+// side effects or are not plain memory (MBC2, RTC, disabled RAM)
+const u8* vram_dma_source(u16 addr)
+{
+    switch (addr >> 12) {
+        case 0x0: case 0x1: case 0x2: case 0x3:
+            return (mbc == 1 && mbc_mode == 1) ? NULL : &rom[addr];
+        case 0x4: case 0x5: case 0x6: case 0x7:
+            return &rom[(addr & 0x3FFF) + ((rom_bank % rom_banks) * BANKSIZE_ROM)]; // never past the ROM
+        case 0xA: case 0xB:
+            if (!eram_enabled || mbc == 2 || (mbc == 3 && rtc_select_reg > 0) || eram_bank >= eram_banks) return NULL;
+            return &eram[(addr & 0x1FFF) + (eram_bank * BANKSIZE_ERAM)];
+        case 0xC:
+            return &wram[addr & 0xFFF];
+        case 0xD:
+            return &wram[(addr & 0xFFF) + wram_bank_offset()];
+    }
+    return NULL;
+}
+
+// Copies 16 byte blocks from hdma_source to VRAM, each one stalls the CPU for 32 dots
+void vram_dma_copy(u8 blocks)
+{
+    u8* bank = &vram[(reg[REG_VBK] & 1) * BANKSIZE_VRAM];
+
+    for (u8 i = 0; i < blocks && hdma_dest < BANKSIZE_VRAM; i++) {
+        const u8* src = vram_dma_source(hdma_source);
+        if (src) memcpy(&bank[hdma_dest], src, 0x10);
+        else for (u8 j = 0; j < 0x10; j++) bank[hdma_dest + j] = read(hdma_source + j);
+        hdma_source += 0x10;
+        hdma_dest += 0x10;
+    }
+    stall_cycles += blocks * (8 << double_speed);
+}
+
+// HDMA5 write: bit 7 clear runs a general purpose DMA right away (or stops a running
+// HBlank DMA), bit 7 set starts an HBlank DMA of one block per HBlank
+void vram_dma_write(u8 value)
+{
+    if (hdma_active && !GET_BIT(value, 7)) {
+        hdma_active = 0;
+        reg[REG_HDMA5] |= 0x80;
+        return;
+    }
+    hdma_source = ((reg[REG_HDMA1] << 8) | reg[REG_HDMA2]) & 0xFFF0;
+    hdma_dest = ((reg[REG_HDMA3] << 8) | reg[REG_HDMA4]) & 0x1FF0;
+    if (GET_BIT(value, 7)) {
+        hdma_active = 1;
+        reg[REG_HDMA5] = value & 0x7F;
+    }
+    else {
+        vram_dma_copy((value & 0x7F) + 1);
+        reg[REG_HDMA5] = 0xFF;
+    }
+    COUNT_DMA();
+}
+
+// Called by the PPU at every HBlank, copies the next block of a running HBlank DMA
+void cpu_hblank()
+{
+    if (!hdma_active) return;
+    vram_dma_copy(1);
+    if (reg[REG_HDMA5] == 0 || hdma_dest >= BANKSIZE_VRAM) {
+        hdma_active = 0;
+        reg[REG_HDMA5] = 0xFF;
+    }
+    else reg[REG_HDMA5]--;
+}
+
+// Byte the running transfer is at, one per M-cycle since it started
+u8 oam_dma_position()
+{
+    u64 position = (cycles_total - dma_start) / tick_dots;
+    return position < 0xA0 ? (u8)position : 0x9F;
+}
+
+// Runs the events that are due, in order
+void run_events()
+{
+    while (cycles_total >= next_event) {
+        u8 event = 0;
+        for (u8 i = 1; i < EVENT_COUNT; i++) {
+            if (event_time[i] < event_time[event]) event = i;
+        }
+        switch (event) {
+            case EVENT_TIMER:
+                timer_overflow();
+                schedule_event(EVENT_TIMER, timer_next_overflow());
+                break;
+            case EVENT_INPUT:
+                cpu_set_buttons(input_events[0].buttons);
+                memmove(&input_events[0], &input_events[1], --input_event_count * sizeof(InputEvent));
+                schedule_event(EVENT_INPUT, input_event_count ? input_events[0].cycle : CYCLES_NEVER);
+                break;
+            case EVENT_PROFILE:
+                profiler_sample(PC, rom_bank);
+                schedule_event(EVENT_PROFILE, event_time[EVENT_PROFILE] + sample_interval);
+                break;
+            case EVENT_DMA:
+                dma_transfer_flag = 0;
+                schedule_event(EVENT_DMA, CYCLES_NEVER);
+                break;
+        }
+    }
+}
+
+// Advances the master clock by one M-cycle. The clock counts dots, which the PPU and
+// APU run on at either speed, so in double speed an M-cycle is only 2 of them.
 void tick() {
-    u8 cycles = 4 >> double_speed;
-    update_inputs();
-    update_timers(cycles);
-    ppu_update(double_speed ? (cycles >> 1) : cycles);
+    cycles_total += tick_dots;
+    if (cycles_total >= next_event) run_events();
+    ppu_update(tick_dots);
+}
+
+// KEY1 armed + STOP: toggles double speed. STOP resets DIV, then the timers and the
+// frame sequencer follow the CPU clock and get rebased. Everything else is scheduled in
+// dots and stays as is. The CPU is held for 2050 M-cycles while the clock settles.
+void switch_speed()
+{
+    u8 dma_position = oam_dma_position();
+
+    apu_div_reset(timer_read(REG_DIV, cycles_total), cycles_total);
+    timer_write(REG_DIV, 0, cycles_total);
+    double_speed ^= 1;
+    tick_dots = 4 >> double_speed;
+    reg[REG_KEY1] = (double_speed << 7) | 0x7E;
+    timer_set_speed(double_speed, cycles_total);
+    schedule_event(EVENT_TIMER, timer_next_overflow());
+    apu_sync_div(timer_counter(cycles_total), double_speed, cycles_total);
+    // A running OAM DMA keeps its progress and moves on at the new rate
+    if (dma_transfer_flag) {
+        dma_start = cycles_total - (u64)dma_position * tick_dots;
+        schedule_event(EVENT_DMA, dma_start + 0xA0 * tick_dots);
+    }
+    stall_cycles += 2050;
 }
 
 u8 execute_instruction(u8 op) {
@@ -1817,8 +2071,8 @@ u8 execute_instruction(u8 op) {
             F_H = 0;
             break;
         case 0x10: // STOP 0
-            t_u8 = 0;
-            // TODO
+            // CGB speed switch when armed through KEY1, otherwise TODO
+            if (cgb_flag && GET_BIT(reg[REG_KEY1], 0)) switch_speed();
             break;
         case 0x11: // LD DE,d16
             DE.low = read(PC++); tick();
@@ -2513,6 +2767,7 @@ u8 execute_instruction(u8 op) {
             break;
         case 0xCB: // Prefix CB
             t_u8 = read(PC++); tick();
+            COUNT_CB_OPCODE(t_u8);
             cycles = execute_cb(t_u8);
             break;
         case 0xCC: // CALL Z,a16
@@ -2832,93 +3087,22 @@ u8 execute_instruction(u8 op) {
     return cycles;
 }
 
-// Updates the P1/JOYP register with the current inputs.
+// Recomputes P1/JOYP from its select bits and the current inputs.
+// Only called when one of them changes: on P1 writes and on host input changes.
 void update_inputs() {
-    // inputs[8] array is sent from SDL once every frame
     //   3      2       1       0 
-    // down    up     left    right
-    //   7      6       5       4     
-    // start  select    B       A 
-    // 
-    // 1 = pressed, 0 = unpressed
-    // need to flip the inputs we got from SDL since the input signals here are reversed
-    u8 select_direction = !GET_BIT(reg[REG_P1], 4);
-    u8 select_action    = !GET_BIT(reg[REG_P1], 5);
-
-    //if (inputs_action != 15) printf("%d", inputs_action);
-    //if (inputs_direction != 15) printf("%d", inputs_direction);
-    //printf("% 2X,", reg[REG_P1]);
+    // down    up     left    right   (bit 4 = 0 selects)
+    // start  select    B       A     (bit 5 = 0 selects)
+    // 0 = pressed, both selected lines are ANDed
     u8 inputs_prev = reg[REG_P1];
+    u8 low = 0xF;
 
-    if (select_direction && select_action) { // AND layouts when both are selected
-        reg[REG_P1] = 0xC0; // 0b 1100 ????
-    }
-    else if (select_action && !select_direction) {
-        reg[REG_P1] = 0xD0; // 0b 1101 ????
-    }
-    else if (select_direction && !select_action) {
-        reg[REG_P1] = 0xE0; // 0b 1110 ????
-    }
-    else { 
-        reg[REG_P1] = 0xFF; // 0b 0011 1111
-    }
-
-    if (select_direction) {
-        reg[REG_P1] |= inputs_direction;
-    }
-    if (select_action) {
-        reg[REG_P1] |= inputs_action;
-    }
-
-    
+    if (!GET_BIT(reg[REG_P1], 4)) low &= inputs_direction;
+    if (!GET_BIT(reg[REG_P1], 5)) low &= inputs_action;
+    reg[REG_P1] = 0xC0 | (reg[REG_P1] & 0x30) | low;
 
     // The Joypad interrupt is requested when any of P1 bits 0-3 change from High to Low
-    // Indicating that a button was pressed
-    for (u8 i=0; i<=3; i++) { 
-        if (GET_BIT(inputs_prev, i) && !GET_BIT(reg[REG_P1], i)) {
-            // Joypad interrupt
-            SET_BIT(reg[REG_IF], INT_BIT_JOYPAD);
-            printf("%d", reg[REG_P1]);
-            printf("int request: joypad\n");
-            break;
-        }
-    }
-}
-
-void update_timers(u8 cycles) {
-    u8 clock = (cycles);
-
-    // DIV is incremented at 16384Hz / 32768Hz in double speed
-    div_counter += clock;
-    if (div_counter > 0xFF) {
-        div_counter &= 0xFF;
-
-        reg[REG_DIV] = (reg[REG_DIV] + 1) & 0xFF;
-    }
-
-    // TIMA is incremented at the clock frequency specified by the TAC register
-    if (timer_enabled) {
-        u16 sp = (timer_speed);
-
-        timer_counter += clock;
-        while (timer_counter > sp) {
-            timer_counter -= sp;
-
-            u8 tima_old = reg[REG_TIMA];
-            reg[REG_TIMA] = (tima_old + 1) & 0xFF;
-            // if overflow occured
-            if (reg[REG_TIMA] < tima_old) {
-                reg[REG_TIMA] = (reg[REG_TIMA] + reg[REG_TMA]);
-
-                // Timer interrupt
-                SET_BIT(reg[REG_IF], INT_BIT_TIMER);
-                //printf("int request: timer\n");
-
-            }
-        }
-    }
-    //printf("DIV: %d, TIMA: %d\n", reg[REG_DIV], reg[REG_TIMA]);
-
+    if (inputs_prev & ~reg[REG_P1] & 0xF) SET_BIT(reg[REG_IF], INT_BIT_JOYPAD);
 }
 
 u8 do_interrupts() {
@@ -2937,6 +3121,7 @@ u8 do_interrupts() {
             if (GET_BIT(reg[REG_IF], i) & GET_BIT(reg[REG_IE], i)) {
                 RESET_BIT(reg[REG_IF], i);
                 interrupts_enabled = 0;
+                COUNT_INTERRUPT(i);
 
                 // CALL interrupt vector
                 // push PC onto stack, then jump to address
@@ -2965,85 +3150,174 @@ u8 do_interrupts() {
     return cycles;
 }
 
-int counter = 1;
-void cpu_update(u8* in)
+// Side effect free read for the trace, I/O registers come back as stored
+u8 peek(u16 addr)
+{
+    if (addr >= MEM_IO && addr < MEM_HRAM) return reg[addr & 0xFF];
+    return read(addr);
+}
+
+// Stores the state before the instruction at PC into the trace ring
+void trace_instruction()
+{
+    TraceRecord* t = &trace_ring[trace_head++ & trace_mask];
+    const u8* mem = NULL;
+
+    t->cycle = cycles_total;
+    t->pc = PC;
+    t->sp = SP.full;
+    t->af = (A << 8) | (F_Z << 7) | (F_N << 6) | (F_H << 5) | (F_C << 4);
+    t->bc = BC.full;
+    t->de = DE.full;
+    t->hl = HL.full;
+    t->bank = rom_bank;
+
+    // Code almost always runs from ROM, copy straight from the mapped bank
+    if (PC < 0x3FFD && !(mbc == 1 && mbc_mode == 1)) mem = &rom[PC];
+    else if (PC >= 0x4000 && PC < 0x7FFD) mem = &rom[(PC & 0x3FFF) + (rom_bank * BANKSIZE_ROM)];
+    if (mem) memcpy(t->bytes, mem, 4);
+    else {
+        for (u8 i = 0; i < 4; i++) t->bytes[i] = peek(PC + i);
+    }
+}
+
+// Follows calls and returns for the profiler's shadow call stack, conditional ones only when taken
+void profile_flow(u8 op, u8 cycles)
+{
+    switch (op) {
+        case 0xCD:                                  // CALL
+        case 0xC7: case 0xCF: case 0xD7: case 0xDF: // RST
+        case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+            profiler_call(PC, rom_bank, SP.full);
+            break;
+        case 0xC4: case 0xCC: case 0xD4: case 0xDC: // CALL cc
+            if (cycles == 24) profiler_call(PC, rom_bank, SP.full);
+            break;
+        case 0xC9: case 0xD9:                       // RET, RETI
+            profiler_return(SP.full);
+            break;
+        case 0xC0: case 0xC8: case 0xD0: case 0xD8: // RET cc
+            if (cycles == 20) profiler_return(SP.full);
+            break;
+    }
+}
+
+// Runs one instruction and services pending interrupts. Time only moves through tick(),
+// which advances the master clock cycles_total.
+void cpu_step()
 {
     u8 op; // the current operand read from memory at PC location
     u8 cycles;
-    int cycles_this_update = 0;
 
-    // Updates inputs array
-    memcpy(inputs, in, 8);
-    inputs_direction = ((!inputs[3] << 3) | (!inputs[2] << 2) | (!inputs[1] << 1) | (!inputs[0] << 0));
-    inputs_action    = ((!inputs[7] << 3) | (!inputs[6] << 2) | (!inputs[5] << 1) | (!inputs[4] << 0));
-    
-    while (cycles_this_update < MAXDOTS)
-    {
-        
-        u8 show_logs = 0;
-        if (show_logs) {
-            if (counter > 0 && counter < 4000)
-            {
-                printf("%06d [%04x] (%02X %02X %02X %02X)  AF=%04x BC=%04x DE=%04x HL=%04x SP=%04x P1=%04X\n",
-                    counter, PC, read(PC), read(PC + 1), read(PC + 2), read(PC + 3), (A << 8) | ((F_Z << 7) | (F_N << 6) | (F_H << 5) | (F_C << 4)),
-                    BC.full, DE.full, HL.full, SP.full, reg[REG_P1]);
-                /*
-                printf("%d A: %02X F: %02X B: %02X C: %02X D: %02X E: %02X H: %02X L: %02X SP: %04X PC: 00:%04X (%02X %02X %02X %02X)\n",
-                    counter, A, ((F_Z << 7) | (F_N << 6) | (F_H << 5) | (F_C << 4)), BC.high, BC.low, DE.high, DE.low, HL.high, HL.low,
-                    SP.full, PC, read(PC), read(PC + 1), read(PC + 2), read(PC + 3));
-                    */
-            }
-            counter++;
-            // Fetch instruction
-            if (counter % 1000 == 0)
-            {
-                u8 i = 0;
-            }
-            if (counter == 251000) {
-                u8 i = 0;
-            }
+    // VRAM DMA and speed switches hold the CPU while the clock keeps running
+    if (stall_cycles) {
+        while (stall_cycles) {
+            stall_cycles--;
+            tick();
         }
+        return;
+    }
 
-        // DMA transfer is running
-        if (dma_transfer_flag) {
-            u8 t_u8 = read((reg[REG_DMA] << 8) | dma_index);
-            tick();
-            oam[dma_index] = t_u8;
-            dma_index++;
-            cycles = 4;
+    if (halted) {
+        op = 0x00; // NOOP
+        COUNT_HALT(4);
+    }
+    else {
+        if (trace_ring) trace_instruction();
+        op = read(PC++);
+        instructions_total++;
+        COUNT_OPCODE(op);
+    }
+    tick();
 
-            if (dma_index > 0x9F) {
-                dma_index = 0;
-                dma_transfer_flag = 0;
-            }
-        }
-        // normal operation
-        else {
-            if (halted) op = 0x00; // NOOP
-            else op = read(PC++);
-            if (halted) {
-                u8 i = 0;
-            }
-            tick();
+    cycles = execute_instruction(op);
+    if (profiling) profile_flow(op, cycles);
 
-            cycles = execute_instruction(op);
-        }
-        
-        //if (!GET_BIT(reg[REG_P1], 4)) printf("1");
-        cycles += do_interrupts();
+    // handle pending interrupts after every instruction
+    if (do_interrupts() && profiling) profiler_call(PC, rom_bank, SP.full);
 
-        cycles_this_update += (cycles >> double_speed);
-        
-        // handle pending interrupts after every instruction
-        
-        // blarggs test - serial output
-        if (reg[REG_SC] == 0x81) {
-            char c = reg[REG_SB];
-            printf("%c", c);
-            reg[REG_SC] = 0x0;
-        }
-        
+    // blarggs test - serial output
+    if (reg[REG_SC] == 0x81) {
+        char c = reg[REG_SB];
+        printf("%c", c);
+        reg[REG_SC] = 0x0;
+    }
+}
+
+// Runs at least the given number of dots, stopping at the first instruction boundary past them
+void gb_run_cycles(u64 dots)
+{
+    u64 target = cycles_total + dots;
+
+    while (cycles_total < target) cpu_step();
+}
+
+// Runs until the PPU moves to LY 144, stopping at the end of the instruction that got it there.
+// One frame worth of dots at most, so frames keep their length while vblank never comes (LCD off).
+void gb_run_until_vblank()
+{
+    u64 limit = cycles_total + MAXDOTS;
+
+    vblank_reached = 0;
+    while (!vblank_reached && cycles_total < limit) cpu_step();
+}
+
+// Applies a button mask (see Button) right away, P1 only changes when the inputs did
+void cpu_set_buttons(u8 buttons)
+{
+    u8 direction = ~buttons & 0xF;
+    u8 action    = (~buttons >> 4) & 0xF;
+
+    if (direction != inputs_direction || action != inputs_action) {
+        inputs_direction = direction;
+        inputs_action = action;
+        update_inputs();
+    }
+}
+
+// Applies the button mask once the master clock reaches event->cycle (right away when it's in the past).
+// Returns -1 when too many events are pending.
+int cpu_queue_input(const InputEvent* event)
+{
+    u8 i = input_event_count;
+
+    if (input_event_count == INPUT_EVENTS_MAX)
+    {
+        fprintf(stderr, "Input event queue is full!\n");
+        return -1;
     }
+    // Keep the events sorted, equal cycles in arrival order
+    while (i > 0 && input_events[i - 1].cycle > event->cycle) {
+        input_events[i] = input_events[i - 1];
+        i--;
+    }
+    input_events[i] = *event;
+    input_event_count++;
+    schedule_event(EVENT_INPUT, input_events[0].cycle);
+    return 0;
+}
+
+u64 cpu_get_cycles()
+{
+    return cycles_total;
+}
+
+u64 cpu_get_instructions()
+{
+    return instructions_total;
+}
+
+// Whether the cartridge runs in CGB mode
+u8 cpu_get_cgb_flag()
+{
+    return cgb_flag;
+}
+
+// Starts (dots > 0) or stops sampling the guest PC for the profiler
+void cpu_set_sample_interval(u32 dots)
+{
+    sample_interval = dots;
+    schedule_event(EVENT_PROFILE, dots ? cycles_total + dots : CYCLES_NEVER);
 }
 
 void cpu_cleanup()
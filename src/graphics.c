@@ -2,12 +2,24 @@
 
 #include "macros.h"
 
+#include <string.h>
+
 
 SDL_GLContext   m_context;
 GLuint          m_vao, m_vbo, m_ebo, m_tex;
 GLuint          m_vert_shader;
 GLuint          m_frag_shader;
 GLuint          m_shader_prog;
+PixelFormat     m_format;
+
+// Pixel buffer objects, the texture is streamed from these asynchronously
+GLuint          m_pbo[PBO_COUNT];
+u8              m_pbo_index;
+UploadMode      m_upload_mode = UPLOAD_DIRECT; // the PBO ring is opt-in (--pbo-upload, F10)
+
+// Upload/present timings, to compare the upload modes
+FrameTimeStats  m_upload_stats;
+FrameTimeStats  m_present_stats;
 
 const char* vert_shader_src = "\
 #version 150 core                                                            \n\
@@ -26,9 +38,13 @@ const char* frag_shader_src = "\
 in vec2 Texcoord;                                                            \n\
 out vec4 out_Color;                                                          \n\
 uniform sampler2D tex;                                                       \n\
+uniform bool indexed;                                                        \n\
+uniform vec4 palette[64];                                                    \n\
 void main()                                                                  \n\
 {                                                                            \n\
-    out_Color = texture(tex, Texcoord);                                      \n\
+    vec4 texel = texture(tex, Texcoord);                                     \n\
+    if (indexed) out_Color = palette[int(texel.r * 255.0 + 0.5)];            \n\
+    else out_Color = texel;                                                  \n\
 }                                                                            \n\
 ";
 
@@ -54,8 +70,6 @@ const SDL_Color palette[] = {
     // ... add more colors to your palette
 };
 
-uint8_t* rgba_buffer = NULL;
-
 
 int graphics_init(SDL_Window* window)
 {
@@ -86,18 +100,16 @@ int graphics_init(SDL_Window* window)
         return 0;
     }
 
-    // Initialize the color buffer
-    if (create_rgba_buffer() == -1)
-    {
-        return 0;
-    }
-
     // Return 0 if failed to initialize
-    if (!init_shaders() || !init_geometry() || !init_textures())
+    if (!init_shaders() || !init_geometry() || !init_textures() || !init_pbos())
     {
         return 0;
     }
 
+    // Upload the color indices and do the palette lookup in the fragment shader
+    graphics_set_pixel_format(PIXEL_FORMAT_INDEX);
+    graphics_set_palette(palette, 4);
+
     return 1;
 }
 
@@ -176,21 +188,35 @@ int init_textures()
     GL_CALL( glGenTextures(1, &m_tex) );
     GL_CALL( glActiveTexture(GL_TEXTURE0) );
     GL_CALL( glBindTexture(GL_TEXTURE_2D, m_tex) );
-    GL_CALL( glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL) );
+    GL_CALL( glPixelStorei(GL_UNPACK_ALIGNMENT, 1) );
     GL_CALL( glUniform1i(glGetUniformLocation(m_shader_prog, "tex"), 0) );
     GL_CALL( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER) );
     GL_CALL( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER) );
     GL_CALL( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST) );
     GL_CALL( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST) );
-    GL_CALL(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV, rgba_buffer) );
     GL_CALL( glEnable(GL_BLEND) );
     GL_CALL( glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) );
     
     return 1;
 }
 
+int init_pbos()
+{
+    GL_CALL( glGenBuffers(PBO_COUNT, m_pbo) );
+    for (u8 i = 0; i < PBO_COUNT; i++) {
+        GL_CALL( glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo[i]) );
+        // Large enough for the widest pixel format
+        GL_CALL( glBufferData(GL_PIXEL_UNPACK_BUFFER, SCREEN_WIDTH * SCREEN_HEIGHT * 4, NULL, GL_STREAM_DRAW) );
+    }
+    GL_CALL( glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0) );
+    m_pbo_index = 0;
+
+    return 1;
+}
+
 void graphics_cleanup()
 {
+    graphics_print_frame_stats();
 
     GL_CALL( glUseProgram(0) );
     GL_CALL( glDisableVertexAttribArray(0) );
@@ -200,25 +226,56 @@ void graphics_cleanup()
     GL_CALL( glDeleteShader(m_vert_shader) );
     GL_CALL( glDeleteShader(m_frag_shader) );
     GL_CALL( glDeleteTextures(1, &m_tex) );
+    GL_CALL( glDeleteBuffers(PBO_COUNT, m_pbo) );
     GL_CALL( glDeleteBuffers(1, &m_ebo) );
     GL_CALL( glDeleteBuffers(1, &m_vbo) );
     GL_CALL( glDeleteVertexArrays(1, &m_vao) );
     SDL_GL_DeleteContext(m_context);
+}
 
-    if (rgba_buffer) free(rgba_buffer);
+// The host colors the PPU should output (white to black)
+const SDL_Color* graphics_get_palette()
+{
+    return palette;
 }
 
-int create_rgba_buffer()
+// Allocates the texture storage for the pixel format the PPU writes.
+// PIXEL_FORMAT_INDEX uses a single channel texture, colors are looked up from the palette uniform.
+void graphics_set_pixel_format(PixelFormat format)
 {
-    // The actual colors (each pixel gets 4 bytes: r,g,b,a)
-    rgba_buffer = (u8*)calloc(SCREEN_WIDTH * SCREEN_HEIGHT * 4, sizeof(u8));
-    //rgba_buffer = (uint8_t*)malloc(160 * 144 * 4);
-    if (rgba_buffer == NULL)
-    {
-        fprintf(stderr, "Failed to allocate memory for the rgba buffer!\n");
-        return -1;
+    m_format = format;
+    switch (format) {
+        case PIXEL_FORMAT_RGBA8888:
+            GL_CALL( glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL) );
+            break;
+        case PIXEL_FORMAT_RGB565:
+            GL_CALL( glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, NULL) );
+            break;
+        default:
+            GL_CALL( glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, NULL) );
+            break;
     }
-    return 0;
+    GL_CALL( glUniform1i(glGetUniformLocation(m_shader_prog, "indexed"), format == PIXEL_FORMAT_INDEX) );
+}
+
+PixelFormat graphics_get_pixel_format()
+{
+    return m_format;
+}
+
+// Updates the colors used by the fragment shader in PIXEL_FORMAT_INDEX (up to 64)
+void graphics_set_palette(const SDL_Color* colors, int count)
+{
+    GLfloat values[MAX_PALETTE_COLORS * 4];
+
+    if (count > MAX_PALETTE_COLORS) count = MAX_PALETTE_COLORS;
+    for (int i = 0; i < count; i++) {
+        values[i * 4]       = colors[i].r / 255.0f;
+        values[i * 4 + 1]   = colors[i].g / 255.0f;
+        values[i * 4 + 2]   = colors[i].b / 255.0f;
+        values[i * 4 + 3]   = colors[i].a / 255.0f;
+    }
+    GL_CALL( glUniform4fv(glGetUniformLocation(m_shader_prog, "palette"), count, values) );
 }
 
 /*
@@ -228,39 +285,105 @@ int8_t* graphics_get_pixel_buffer()
 }
 */
 
-void graphics_update_rgba_buffer(u8* color_index_buffer)
+// Switches between uploading straight from client memory and streaming through the PBO ring
+void graphics_set_upload_mode(UploadMode mode)
 {
-    // Iterate through a buffer of color_index and update the rgba buffer
-    // with the corresponding colors from the palette
-    int16_t     buffer_size = SCREEN_WIDTH * SCREEN_HEIGHT;
-    SDL_Color   color;
-    int         pos;
-
-    for (int i = 0; i < buffer_size; i++) {
-        pos = i * 4;
-        color = palette[color_index_buffer[i]];
-
-        rgba_buffer[pos]     = color.r;
-        rgba_buffer[pos + 1] = color.g;
-        rgba_buffer[pos + 2] = color.b;
-        rgba_buffer[pos + 3] = color.a;
-    }
+    m_upload_mode = mode;
+    memset(&m_upload_stats, 0, sizeof(m_upload_stats));
+    memset(&m_present_stats, 0, sizeof(m_present_stats));
+}
 
-    /*
-    // print out the buffer contents
-    buffer_size = 160 * 144 * 4;
-    char* str;
-    for (int i = 0; i < buffer_size; i++) {
-        printf("%d ", rgba_buffer[i]);
+// The mode in use, PBO uploads fall back to direct ones when a buffer fails to map
+UploadMode graphics_get_upload_mode()
+{
+    return m_upload_mode;
+}
+
+void add_frame_time(FrameTimeStats* stats, Uint64 start)
+{
+    double ms = (double)(SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+    stats->count++;
+    stats->total_ms += ms;
+    if (ms > stats->max_ms) stats->max_ms = ms;
+}
+
+void graphics_get_frame_stats(FrameTimeStats* upload, FrameTimeStats* present)
+{
+    if (upload)  *upload  = m_upload_stats;
+    if (present) *present = m_present_stats;
+}
+
+void graphics_print_frame_stats()
+{
+    const char* mode = (m_upload_mode == UPLOAD_PBO) ? "pbo" : "direct";
+    if (m_upload_stats.count == 0) return;
+
+    printf("Texture upload (%s): avg %.3f ms, max %.3f ms over %u frames\n",
+        mode, m_upload_stats.total_ms / m_upload_stats.count, m_upload_stats.max_ms, m_upload_stats.count);
+    if (m_present_stats.count == 0) return;
+    printf("Present (%s): avg %.3f ms, max %.3f ms over %u frames\n",
+        mode, m_present_stats.total_ms / m_present_stats.count, m_present_stats.max_ms, m_present_stats.count);
+}
+
+void graphics_update_rgba_buffer(u8* pixel_buffer)
+{
+    GLenum  gl_format, gl_type;
+    int     size;
+    Uint64  start = SDL_GetPerformanceCounter();
+
+    // The PPU already wrote the final pixels (see ppu_set_output_format),
+    // so the buffer can be uploaded as is.
+    switch (m_format) {
+        case PIXEL_FORMAT_RGBA8888:
+            gl_format = GL_RGBA;
+            gl_type = GL_UNSIGNED_BYTE;
+            size = SCREEN_WIDTH * SCREEN_HEIGHT * 4;
+            break;
+        case PIXEL_FORMAT_RGB565:
+            gl_format = GL_RGB;
+            gl_type = GL_UNSIGNED_SHORT_5_6_5;
+            size = SCREEN_WIDTH * SCREEN_HEIGHT * 2;
+            break;
+        default:
+            // 1 byte per pixel, a quarter of the RGBA upload
+            gl_format = GL_RED;
+            gl_type = GL_UNSIGNED_BYTE;
+            size = SCREEN_WIDTH * SCREEN_HEIGHT;
+            break;
     }
-    */
 
-    // Update the texture with the new color data
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, rgba_buffer);
+    if (m_upload_mode == UPLOAD_PBO) {
+        void* ptr;
+
+        // Write into the next buffer of the ring while the GPU may still be reading the previous ones
+        m_pbo_index = (m_pbo_index + 1) % PBO_COUNT;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbo[m_pbo_index]);
+        ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (ptr) {
+            memcpy(ptr, pixel_buffer, size);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            // Sources from the bound PBO, returns without waiting for the copy
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, gl_format, gl_type, NULL);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (!ptr) {
+            fprintf(stderr, "Failed to map the pixel buffer object, falling back to direct uploads\n");
+            m_upload_mode = UPLOAD_DIRECT;
+        }
+        else {
+            add_frame_time(&m_upload_stats, start);
+            return;
+        }
+    }
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, gl_format, gl_type, pixel_buffer);
+    add_frame_time(&m_upload_stats, start);
 }
 
 void graphics_draw(SDL_Window* window)
 {
+    Uint64 start = SDL_GetPerformanceCounter();
+
     // Clears the screen buffer to red
     glClearColor(1.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -270,5 +393,5 @@ void graphics_draw(SDL_Window* window)
 
     // Sends the render to SDL
     SDL_GL_SwapWindow(window);
-    return 0;
+    add_frame_time(&m_present_stats, start);
 }
\ No newline at end of file
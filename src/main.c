@@ -1,14 +1,45 @@
 
 #include <stdlib.h> 
 #include <stdio.h>
+#include <string.h>
 
 #include "application.h"
 
-int main(void) {
+#define DEFAULT_ROM "C:/dev/AluBoy/AluBoy/resources/roms/Tetris (World) (Rev 1).gb"
 
-    if (application_init("AluGB") == -1) return -1;
+// Usage: AluBoy [rom] [--headless] [--frames n] [--wav file] [--record file [--hash]] [--play file] [--uncapped] [--counters]
+//              [--trace file [--trace-size n]] [--profile file [--profile-interval n] [--sym file]]
+//              [--timeline file] [--pbo-upload]
+int main(int argc, char* argv[]) {
+
+    AppOptions options = { DEFAULT_ROM, 0, 3600, NULL, NULL, NULL, 0, 0, 0, NULL, 0, NULL, 0, NULL, NULL, 0 };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0)                 options.headless = 1;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) options.frames = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--wav") == 0 && i + 1 < argc)    options.wav_path = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) options.record_path = argv[++i];
+        else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc)   options.play_path = argv[++i];
+        else if (strcmp(argv[i], "--hash") == 0)                options.frame_hashes = 1;
+        else if (strcmp(argv[i], "--uncapped") == 0)            options.uncapped = 1;
+        else if (strcmp(argv[i], "--counters") == 0)            options.counters = 1;
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)  options.trace_path = argv[++i];
+        else if (strcmp(argv[i], "--trace-size") == 0 && i + 1 < argc) options.trace_size = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) options.profile_path = argv[++i];
+        else if (strcmp(argv[i], "--profile-interval") == 0 && i + 1 < argc) options.profile_interval = (u32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--sym") == 0 && i + 1 < argc)    options.sym_path = argv[++i];
+        else if (strcmp(argv[i], "--timeline") == 0 && i + 1 < argc) options.timeline_path = argv[++i];
+        else if (strcmp(argv[i], "--pbo-upload") == 0)          options.pbo_upload = 1;
+        else if (argv[i][0] != '-')                             options.rom_path = argv[i];
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (application_init("AluGB", &options) == -1) return -1;
     
-    application_update();   // Runs until window is closed
+    application_update();   // Runs until window is closed, or for options.frames when headless
 
     application_cleanup();  // Free memory stuff
     
@@ -0,0 +1,315 @@
+#include "movie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// File layout, little endian:
+//   "AMOV", u8 version, u8 start state, u8 flags, u8 reserved
+//   u64 ROM hash, u32 frames, u32 runs
+//   runs:   u8 button mask, u16 frames
+//   hashes: u64 per frame, when MOVIE_FLAG_HASHES is set
+#define MOVIE_HEADER_SIZE   24
+#define MOVIE_RUN_SIZE      3
+#define MOVIE_FLAG_HASHES   0x1
+
+typedef struct MovieRun {
+    u8  buttons;
+    u16 frames;
+} MovieRun;
+
+enum MovieMode {
+    MOVIE_OFF,
+    MOVIE_RECORD,
+    MOVIE_PLAY
+};
+
+u8          movie_mode = MOVIE_OFF;
+char*       movie_path = NULL;     // recording, written on stop
+u64         rom_hash;
+u8          movie_flags;
+
+MovieRun*   runs = NULL;
+u32         run_count;
+u32         run_capacity;
+u64*        hashes = NULL;
+u32         hash_capacity;
+u32         frame_count;
+
+// Playback position
+u32         run_index;
+u32         run_pos;
+u32         frame_index;    // frames handed out by movie_next_frame
+u8          frame_pending;  // the last one hasn't been hashed yet
+u32         mismatches;
+u32         first_mismatch;
+
+// PRIVATE --------------------------------------------------
+
+void put_le(u8* p, u64 v, u8 bytes)
+{
+    for (u8 i = 0; i < bytes; i++) p[i] = (v >> (i * 8)) & 0xFF;
+}
+
+u64 get_le(const u8* p, u8 bytes)
+{
+    u64 v = 0;
+    for (u8 i = 0; i < bytes; i++) v |= (u64)p[i] << (i * 8);
+    return v;
+}
+
+// Doubles an array when it is full
+int grow(void** array, u32* capacity, u32 count, u32 elem_size)
+{
+    void* p;
+
+    if (count < *capacity) return 0;
+    p = realloc(*array, (size_t)(*capacity ? *capacity * 2 : 256) * elem_size);
+    if (p == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the movie!\n");
+        return -1;
+    }
+    *array = p;
+    *capacity = *capacity ? *capacity * 2 : 256;
+    return 0;
+}
+
+void free_movie()
+{
+    if (runs) free(runs);
+    if (hashes) free(hashes);
+    if (movie_path) free(movie_path);
+    runs = NULL;
+    hashes = NULL;
+    movie_path = NULL;
+    run_count = run_capacity = 0;
+    hash_capacity = 0;
+    frame_count = 0;
+    movie_mode = MOVIE_OFF;
+}
+
+int write_movie()
+{
+    u8      header[MOVIE_HEADER_SIZE] = { 'A', 'M', 'O', 'V', MOVIE_VERSION, MOVIE_START_POWER_ON, movie_flags, 0 };
+    u8      run[MOVIE_RUN_SIZE];
+    u8      hash[8];
+    FILE*   fp;
+
+    fp = fopen(movie_path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", movie_path);
+        perror("Error: ");
+        return -1;
+    }
+    put_le(header + 8, rom_hash, 8);
+    put_le(header + 16, frame_count, 4);
+    put_le(header + 20, run_count, 4);
+    fwrite(header, 1, MOVIE_HEADER_SIZE, fp);
+
+    for (u32 i = 0; i < run_count; i++) {
+        run[0] = runs[i].buttons;
+        put_le(run + 1, runs[i].frames, 2);
+        fwrite(run, 1, MOVIE_RUN_SIZE, fp);
+    }
+    if (movie_flags & MOVIE_FLAG_HASHES) {
+        for (u32 i = 0; i < frame_count; i++) {
+            put_le(hash, hashes[i], 8);
+            fwrite(hash, 1, 8, fp);
+        }
+    }
+    if (ferror(fp)) {
+        perror("Error: ");
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+// PUBLIC --------------------------------------------------
+
+// FNV-1a, identifies ROMs and frames
+u64 movie_hash(const u8* data, u32 size)
+{
+    u64 h = 0xCBF29CE484222325ULL;
+
+    for (u32 i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+// Records from power on, the file is written by movie_stop
+int movie_record_start(const char* path, const u8* rom, u32 rom_size, u8 frame_hashes)
+{
+    free_movie();
+    movie_path = (char*)malloc(strlen(path) + 1);
+    if (movie_path == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the movie!\n");
+        return -1;
+    }
+    strcpy(movie_path, path);
+
+    rom_hash = movie_hash(rom, rom_size);
+    movie_flags = frame_hashes ? MOVIE_FLAG_HASHES : 0;
+    movie_mode = MOVIE_RECORD;
+    return 0;
+}
+
+// Loads a movie recorded on the same ROM, to be played from power on
+int movie_play_start(const char* path, const u8* rom, u32 rom_size)
+{
+    u8      header[MOVIE_HEADER_SIZE];
+    u8      buffer[8];
+    u32     total = 0;
+    u8      empty_run = 0;
+    FILE*   fp;
+
+    free_movie();
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        perror("Error: ");
+        return -1;
+    }
+    if (fread(header, 1, MOVIE_HEADER_SIZE, fp) != MOVIE_HEADER_SIZE
+        || memcmp(header, "AMOV", 4) != 0 || header[4] != MOVIE_VERSION || header[5] != MOVIE_START_POWER_ON)
+    {
+        fprintf(stderr, "Not a supported movie: %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    if (get_le(header + 8, 8) != movie_hash(rom, rom_size))
+    {
+        fprintf(stderr, "The movie was recorded on a different ROM: %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    movie_flags = header[6];
+    frame_count = (u32)get_le(header + 16, 4);
+    run_count = (u32)get_le(header + 20, 4);
+
+    runs = (MovieRun*)malloc((size_t)(run_count ? run_count : 1) * sizeof(MovieRun));
+    hashes = (movie_flags & MOVIE_FLAG_HASHES) ? (u64*)malloc((size_t)(frame_count ? frame_count : 1) * sizeof(u64)) : NULL;
+    if (runs == NULL || ((movie_flags & MOVIE_FLAG_HASHES) && hashes == NULL))
+    {
+        fprintf(stderr, "Failed to allocate memory for the movie!\n");
+        fclose(fp);
+        free_movie();
+        return -1;
+    }
+    for (u32 i = 0; i < run_count; i++) {
+        if (fread(buffer, 1, MOVIE_RUN_SIZE, fp) != MOVIE_RUN_SIZE) break;
+        runs[i].buttons = buffer[0];
+        runs[i].frames = (u16)get_le(buffer + 1, 2);
+        if (runs[i].frames == 0) empty_run = 1; // would never end during playback
+        total += runs[i].frames;
+    }
+    for (u32 i = 0; hashes && i < frame_count; i++) {
+        if (fread(buffer, 1, 8, fp) != 8) break;
+        hashes[i] = get_le(buffer, 8);
+    }
+    if (ferror(fp) || feof(fp) || total != frame_count)
+    {
+        fprintf(stderr, "Truncated movie: %s\n", path);
+        fclose(fp);
+        free_movie();
+        return -1;
+    }
+    if (empty_run)
+    {
+        fprintf(stderr, "Corrupt movie: %s\n", path);
+        fclose(fp);
+        free_movie();
+        return -1;
+    }
+    fclose(fp);
+
+    run_index = 0;
+    run_pos = 0;
+    frame_index = 0;
+    frame_pending = 0;
+    mismatches = 0;
+    movie_mode = MOVIE_PLAY;
+    return 0;
+}
+
+// Ends recording (writes the file) or playback (reports the verification)
+void movie_stop()
+{
+    if (movie_mode == MOVIE_RECORD) {
+        if (write_movie() == 0) printf("Movie: recorded %u frames in %u runs\n", frame_count, run_count);
+    }
+    else if (movie_mode == MOVIE_PLAY && (movie_flags & MOVIE_FLAG_HASHES)) {
+        if (mismatches) printf("Movie: %u of %u frames differ, first at frame %u\n", mismatches, frame_index, first_mismatch);
+        else            printf("Movie: %u frames verified\n", frame_index);
+    }
+    free_movie();
+}
+
+u8 movie_recording()
+{
+    return movie_mode == MOVIE_RECORD;
+}
+
+// Whether frames are left to play
+u8 movie_playing()
+{
+    return movie_mode == MOVIE_PLAY && run_index < run_count;
+}
+
+// Appends the mask applied at the start of a frame
+void movie_record_frame(u8 buttons)
+{
+    if (movie_mode != MOVIE_RECORD) return;
+
+    if (run_count > 0 && runs[run_count - 1].buttons == buttons && runs[run_count - 1].frames < MOVIE_MAX_RUN) {
+        runs[run_count - 1].frames++;
+    }
+    else {
+        if (grow((void**)&runs, &run_capacity, run_count, sizeof(MovieRun)) == -1) return;
+        runs[run_count].buttons = buttons;
+        runs[run_count].frames = 1;
+        run_count++;
+    }
+    frame_count++;
+}
+
+// The mask to apply at the start of the next frame, returns 0 when the movie ended
+int movie_next_frame(u8* buttons)
+{
+    if (!movie_playing()) return 0;
+
+    *buttons = runs[run_index].buttons;
+    frame_index++;
+    frame_pending = 1;
+    if (++run_pos == runs[run_index].frames) {
+        run_index++;
+        run_pos = 0;
+    }
+    return 1;
+}
+
+// Called after every frame: stores its hash when recording, compares it when playing
+void movie_frame_done(const u8* pixels, u32 size)
+{
+    if (!(movie_flags & MOVIE_FLAG_HASHES) || movie_mode == MOVIE_OFF) return;
+
+    if (movie_mode == MOVIE_RECORD) {
+        // One hash per recorded frame
+        if (frame_count == 0) return;
+        if (grow((void**)&hashes, &hash_capacity, frame_count - 1, sizeof(u64)) == -1) return;
+        hashes[frame_count - 1] = movie_hash(pixels, size);
+    }
+    else if (frame_pending) {
+        // Only frames with a recorded hash are compared
+        if (frame_index <= frame_count && hashes[frame_index - 1] != movie_hash(pixels, size)) {
+            if (mismatches == 0) first_mismatch = frame_index - 1;
+            mismatches++;
+        }
+        frame_pending = 0;
+    }
+}
@@ -0,0 +1,127 @@
+#include "pacing.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <SDL.h>
+
+#define SPIN_THRESHOLD_MS   2.0     // SDL_Delay can overshoot by ~1ms, spin for the rest
+#define MAX_LAG_FRAMES      4       // resync instead of catching up after a long stall
+#define MATCH_TOLERANCE     0.01    // run at the display rate when it's within 1% of the DMG rate
+
+SDL_atomic_t    target_mhz;         // target rate in millihertz, may be changed from the render thread
+Uint64          next_deadline;      // performance counter value at which the next frame starts
+Uint64          last_frame;
+Uint64          counter_freq;
+
+// Frame time statistics (Welford's running variance)
+u32     stat_frames;
+double  stat_mean;
+double  stat_m2;
+double  stat_min;
+double  stat_max;
+
+void pacing_init(double target_hz)
+{
+    counter_freq = SDL_GetPerformanceFrequency();
+    pacing_set_target(target_hz);
+    next_deadline = SDL_GetPerformanceCounter();
+    last_frame = 0;
+    pacing_reset_stats();
+}
+
+void pacing_set_target(double target_hz)
+{
+    SDL_AtomicSet(&target_mhz, (int)(target_hz * 1000.0 + 0.5));
+}
+
+double pacing_get_target()
+{
+    return SDL_AtomicGet(&target_mhz) / 1000.0;
+}
+
+// Dynamic rate matching: paces to the measured display refresh rate when it is close to the DMG rate,
+// so every vsync gets exactly one frame. Returns whether the rate was matched.
+int pacing_match_refresh(double refresh_hz)
+{
+    if (refresh_hz > 0 && fabs(refresh_hz - DMG_FRAME_HZ) / DMG_FRAME_HZ <= MATCH_TOLERANCE) {
+        pacing_set_target(refresh_hz);
+        return 1;
+    }
+    pacing_set_target(DMG_FRAME_HZ);
+    return 0;
+}
+
+// Blocks until the next frame deadline. Deadlines advance by exactly one period,
+// so rounding errors of the waits never accumulate into drift.
+void pacing_wait()
+{
+    Uint64  now;
+    Uint64  period = (Uint64)(counter_freq * 1000.0 / SDL_AtomicGet(&target_mhz));
+    double  remaining_ms;
+
+    next_deadline += period;
+    now = SDL_GetPerformanceCounter();
+
+    // Fell too far behind (breakpoint, window drag...), start over from now
+    if (now > next_deadline + period * MAX_LAG_FRAMES) {
+        next_deadline = now;
+    }
+
+    // Sleep for the bulk of the wait, then spin until the deadline
+    while (now < next_deadline) {
+        remaining_ms = (double)(next_deadline - now) * 1000.0 / counter_freq;
+        if (remaining_ms > SPIN_THRESHOLD_MS) {
+            SDL_Delay((u32)(remaining_ms - SPIN_THRESHOLD_MS));
+        }
+        now = SDL_GetPerformanceCounter();
+    }
+
+    if (last_frame != 0) {
+        double ms = (double)(now - last_frame) * 1000.0 / counter_freq;
+        double delta = ms - stat_mean;
+
+        stat_frames++;
+        stat_mean += delta / stat_frames;
+        stat_m2 += delta * (ms - stat_mean);
+        if (ms < stat_min) stat_min = ms;
+        if (ms > stat_max) stat_max = ms;
+    }
+    last_frame = now;
+}
+
+// Maps a host time (performance counter) to emulated dots relative to the start of the current frame,
+// negative when it is earlier. The emulated clock runs at one frame per period of the target rate.
+s64 pacing_cycles_from_frame(u64 host_time)
+{
+    double seconds = (double)(s64)(host_time - next_deadline) / counter_freq;
+    return (s64)(seconds * DMG_FRAME_DOTS * pacing_get_target());
+}
+
+void pacing_get_stats(PacingStats* stats)
+{
+    stats->frames       = stat_frames;
+    stats->target_ms    = 1000.0 / pacing_get_target();
+    stats->mean_ms      = stat_mean;
+    stats->stddev_ms    = (stat_frames > 1) ? sqrt(stat_m2 / (stat_frames - 1)) : 0.0;
+    stats->min_ms       = (stat_frames > 0) ? stat_min : 0.0;
+    stats->max_ms       = stat_max;
+}
+
+void pacing_reset_stats()
+{
+    stat_frames = 0;
+    stat_mean = 0.0;
+    stat_m2 = 0.0;
+    stat_min = 1e9;
+    stat_max = 0.0;
+}
+
+void pacing_print_stats()
+{
+    PacingStats stats;
+
+    pacing_get_stats(&stats);
+    if (stats.frames == 0) return;
+    printf("Frame time: target %.3f ms, mean %.3f ms, stddev %.3f ms, min %.3f ms, max %.3f ms over %u frames\n",
+        stats.target_ms, stats.mean_ms, stats.stddev_ms, stats.min_ms, stats.max_ms, stats.frames);
+}
@@ -2,10 +2,14 @@
 #include "macros.h"
 
 #include <stdio.h>
+#include <string.h>
 #include "emu_shared.h"
+#include "cpu.h"
+#include "timeline.h"
 
 #define PIXELS_PER_BYTE 1
 #define BITS_PER_PIXEL  8
+#define MAX_BYTES_PER_PIXEL 4
 
 u8* sprite_buffer      = NULL;
 u8* background_buffer  = NULL;
@@ -19,10 +23,39 @@ u16 scanline_counter; // every >SCANLINE_DOTS, update LY
 u16 tm_addr_prev        = 0;
 int tile_index_prev     = 1;
 
+// Window line being drawn, only counts the lines the window was visible on
+u8  window_line;
+
+// Output format
+PixelFormat output_format   = PIXEL_FORMAT_INDEX;
+u8  bytes_per_pixel         = 1;
+u32 host_lut[4]             = { 0, 1, 2, 3 }; // shade -> host pixel value
+
+// Per-line LUTs, combining BGP/OBP0/OBP1 with the host colors
+u32 bg_lut[4];
+u32 obj_lut[2][4];
+u8  bgp_prev  = 0;
+u8  obp0_prev = 0;
+u8  obp1_prev = 0;
+u8  lut_dirty = 1;
+
+// CGB palette RAM (8 palettes of 4 RGB555 colors, little endian) for BG and OBJ,
+// kept converted to the output format through rgb555_lut on every write
+u8  palette_ram[2][64];
+u32 cgb_colors[2][8][4];
+u32 rgb555_lut[0x8000];
+
+// Scanline being composed
+u8  line_index[SCREEN_WIDTH];   // raw BG/window color index, used for OBJ priority
+u8  line_priority[SCREEN_WIDTH];// CGB: BG map attribute bit 7, the tile is drawn over objects
+u32 line_pixels[SCREEN_WIDTH];  // final pixel values in the output format
+
 // FORWARD DECLARE
 void draw_scanline(u8 y);
 void draw_tiles(u8 y);
+void draw_tiles_cgb(u8 y);
 void draw_sprites(u8 y);
+void update_rgb555_lut();
 
 // PUBLIC --------------------------------------------------
 
@@ -38,7 +71,8 @@ int ppu_init()
         return -1;
     }
 
-    background_buffer = (u8*)calloc(buffer_size, sizeof(u8));
+    // Large enough for the widest output format
+    background_buffer = (u8*)calloc(SCREEN_WIDTH * SCREEN_HEIGHT * MAX_BYTES_PER_PIXEL, sizeof(u8));
     if (background_buffer == NULL)
     {
         fprintf(stderr, "Failed to allocate memory for the background buffer!\n");
@@ -52,16 +86,76 @@ int ppu_init()
         return -1;
     }
 
+    // Palettes start out white
+    memset(palette_ram, 0xFF, sizeof(palette_ram));
+    update_rgb555_lut();
+
     redraw_flag = 1;
     return 0;
 }
 
+// Registers the pixel format written to the pixel buffer, along with the 4 host colors (white to black).
+// colors is ignored for PIXEL_FORMAT_INDEX.
+void ppu_set_output_format(PixelFormat format, const SDL_Color* colors)
+{
+    output_format = format;
+    for (u8 i = 0; i < 4; i++) {
+        switch (format) {
+            case PIXEL_FORMAT_RGBA8888:
+                host_lut[i] = colors[i].r | (colors[i].g << 8) | (colors[i].b << 16) | ((u32)colors[i].a << 24);
+                break;
+            case PIXEL_FORMAT_RGB565:
+                host_lut[i] = ((colors[i].r >> 3) << 11) | ((colors[i].g >> 2) << 5) | (colors[i].b >> 3);
+                break;
+            default:
+                host_lut[i] = i;
+                break;
+        }
+    }
+    switch (format) {
+        case PIXEL_FORMAT_RGBA8888: bytes_per_pixel = 4; break;
+        case PIXEL_FORMAT_RGB565:   bytes_per_pixel = 2; break;
+        default:                    bytes_per_pixel = 1; break;
+    }
+    update_rgb555_lut();
+    lut_dirty = 1;
+    redraw_flag = 1;
+}
+
+// BGPD / OBPD write: stores at the index in BGPI / OBPI, which increments if its bit 7 is set
+void ppu_write_palette(u8 obj, u8 value)
+{
+    u8* spec    = &reg[obj ? REG_OBPI : REG_BGPI];
+    u8  index   = *spec & 0x3F;
+    u8* color   = &palette_ram[obj][index & 0x3E];
+
+    color[index & 1] = value;
+    cgb_colors[obj][index >> 3][(index >> 1) & 3] = rgb555_lut[(color[0] | (color[1] << 8)) & 0x7FFF];
+    if (GET_BIT(*spec, 7)) *spec = (*spec & 0x80) | ((index + 1) & 0x3F);
+}
+
+u8 ppu_read_palette(u8 obj)
+{
+    return palette_ram[obj][reg[obj ? REG_OBPI : REG_BGPI] & 0x3F];
+}
+
+PixelFormat ppu_get_output_format()
+{
+    return output_format;
+}
+
 // Used for passing the pixel buffer to GL
 u8* ppu_get_pixel_buffer()
 {
     return background_buffer;
 }
 
+// Size in bytes of a frame in the current output format
+u32 ppu_get_pixel_buffer_size()
+{
+    return SCREEN_WIDTH * SCREEN_HEIGHT * bytes_per_pixel;
+}
+
 // Whether the screen needs to be redrawn
 u8 ppu_get_redraw_flag() {
     return redraw_flag;
@@ -74,6 +168,13 @@ void ppu_update(u8 cycles)
 {
     u8 clock = cycles;
 
+    // LCD off: LY stays at 0 and no lines (or vblanks) pass until it is turned back on
+    if (!GET_BIT(reg[REG_LCDC], LCDC_ENABLE)) {
+        reg[REG_LY] = 0;
+        scanline_counter = 0;
+        return;
+    }
+
     //printf("%d,", reg[REG_STAT]);
     scanline_counter += clock;
     // Reached end of scanline
@@ -89,7 +190,11 @@ void ppu_update(u8 cycles)
         }
         // Move to a new scanline
         reg[REG_LY] ++;
-        if (reg[REG_LY] >= 0x9A) reg[REG_LY] = 0;
+        if (reg[REG_LY] >= 0x9A) {
+            reg[REG_LY] = 0;
+            timeline_end(TIMELINE_EMULATION, "vblank");
+        }
+        timeline_instant(TIMELINE_EMULATION, "scanline", reg[REG_LY]);
 
         // VBlank
         if (reg[REG_LY] == SCREEN_HEIGHT) {
@@ -99,6 +204,8 @@ void ppu_update(u8 cycles)
 
             // Vblank interrupt request
             SET_BIT(reg[REG_IF], INT_BIT_VBLANK);
+            vblank_reached = 1;
+            timeline_begin(TIMELINE_EMULATION, "vblank");
 
             // request interrupt if enabled
             if (GET_BIT(reg[REG_STAT], STAT_INT_VBLANK)) {
@@ -115,6 +222,7 @@ void ppu_update(u8 cycles)
             }
 
             // HBLANK HDMA
+            cpu_hblank();
 
             // DEBUG Draw entire line //////////////////////////////
             draw_scanline(reg[REG_LY] == 0 ? (SCREEN_HEIGHT - 1) : (reg[REG_LY] - 1));
@@ -140,23 +248,106 @@ void ppu_cleanup()
 
 // PRIVATE --------------------------------------------------
 
-// Returns whether or not the pixel was modified
-u8 set_pixel(u16 pos, u8 color_index)
+// Converts every RGB555 color to the output format, then the palette RAM with it.
+// The index format has no colors, it gets the nearest of the 4 shades by brightness.
+void update_rgb555_lut()
+{
+    for (u32 c = 0; c < 0x8000; c++) {
+        u8 r = c & 0x1F, g = (c >> 5) & 0x1F, b = (c >> 10) & 0x1F;
+        switch (output_format) {
+            case PIXEL_FORMAT_RGBA8888:
+                rgb555_lut[c] = ((r << 3) | (r >> 2)) | (((g << 3) | (g >> 2)) << 8) | (((b << 3) | (b >> 2)) << 16) | 0xFF000000u;
+                break;
+            case PIXEL_FORMAT_RGB565:
+                rgb555_lut[c] = (r << 11) | (((g << 1) | (g >> 4)) << 5) | b;
+                break;
+            default:
+                rgb555_lut[c] = host_lut[3 - ((r * 3 + g * 6 + b) * 4 / (31 * 10 + 1))];
+                break;
+        }
+    }
+    for (u8 obj = 0; obj < 2; obj++) {
+        for (u8 i = 0; i < 32; i++) {
+            u8* color = &palette_ram[obj][i * 2];
+            cgb_colors[obj][i >> 2][i & 3] = rgb555_lut[(color[0] | (color[1] << 8)) & 0x7FFF];
+        }
+    }
+}
+
+// Rebuilds the per-line LUTs when any of the DMG palette registers changed
+void update_line_lut()
+{
+    u8 bgp  = reg[REG_BGP];
+    u8 obp0 = reg[REG_OBP0];
+    u8 obp1 = reg[REG_OBP1];
+
+    if (!lut_dirty && bgp == bgp_prev && obp0 == obp0_prev && obp1 == obp1_prev) return;
+
+    for (u8 i = 0; i < 4; i++) {
+        bg_lut[i]       = host_lut[(bgp  >> (i * 2)) & 3];
+        obj_lut[0][i]   = host_lut[(obp0 >> (i * 2)) & 3];
+        obj_lut[1][i]   = host_lut[(obp1 >> (i * 2)) & 3];
+    }
+    bgp_prev  = bgp;
+    obp0_prev = obp0;
+    obp1_prev = obp1;
+    lut_dirty = 0;
+}
+
+// Copies the composed scanline into the pixel buffer, flags a redraw if anything changed
+void output_line(u8 y)
 {
-    u8 color_index_prev = background_buffer[pos];
-    // Set the pixel value in the pixel buffer
-    background_buffer[pos] = color_index;
+    u8  changed = 0;
+    u16 pos     = y * SCREEN_WIDTH;
 
-    return (color_index_prev != color_index);
+    switch (bytes_per_pixel) {
+        case 4:
+        {
+            u32* dst = (u32*)background_buffer + pos;
+            changed = memcmp(dst, line_pixels, sizeof(line_pixels)) != 0;
+            if (changed) memcpy(dst, line_pixels, sizeof(line_pixels));
+        } break;
+        case 2:
+        {
+            u16* dst = (u16*)background_buffer + pos;
+            for (u8 x = 0; x < SCREEN_WIDTH; x++) {
+                changed |= (dst[x] != (u16)line_pixels[x]);
+                dst[x] = (u16)line_pixels[x];
+            }
+        } break;
+        default:
+        {
+            u8* dst = background_buffer + pos;
+            for (u8 x = 0; x < SCREEN_WIDTH; x++) {
+                changed |= (dst[x] != (u8)line_pixels[x]);
+                dst[x] = (u8)line_pixels[x];
+            }
+        } break;
+    }
+    // Tell screen to redraw at the next step
+    if (changed) redraw_flag = 1;
 }
 
 void draw_scanline(u8 y) {
-    if (GET_BIT(reg[REG_LCDC], LCDC_BGW_ENABLE)) {
+    update_line_lut();
+    if (y == 0) window_line = 0;
+
+    // CGB: LCDC bit 0 only takes the priority away from the BG, it is always drawn
+    if (cgb_flag) {
+        draw_tiles_cgb(y);
+    }
+    else if (GET_BIT(reg[REG_LCDC], LCDC_BGW_ENABLE)) {
         draw_tiles(y);
     }
+    else {
+        // BG and window are blank (white)
+        memset(line_index, 0, sizeof(line_index));
+        for (u8 x = 0; x < SCREEN_WIDTH; x++) line_pixels[x] = host_lut[0];
+    }
     if (GET_BIT(reg[REG_LCDC], LCDC_OBJ_ENABLE)) {
         draw_sprites(y);
     }
+    output_line(y);
 }
 
 // Draws the Background & Window
@@ -173,31 +364,41 @@ void draw_tiles(u8 y) {
 
     u8  window_in_line = 0;
     u8  byte1 = 0, byte2 = 0;
-    u8  pixel_updated = 0;
     
     u16 bg_y    = ( ((y + sy) & 0xFF) >> 3) << 5; // translate the background coordinates to the screen ((row / 8) * 32)
-    u16 win_y   = ( ((wy - y) & 0xFF) >> 3) << 5; // translate the window coordinates to the screen
-    u8  row     = y % 8;
+    u16 win_y   = (window_line >> 3) << 5;        // the window has its own line counter
+    u8  bg_row  = (y + sy) & 7;                   // fine scroll, like the columns below
+    u8  win_row = window_line & 7;
 
     u8  color_index;
     u16 td_addr, pixel_offset;
 
-    // Check if window is enabled and visible at this scanline
-    if (GET_BIT(reg[REG_LCDC], LCDC_W_ENABLE) && wy <= y) {
+    // Check if window is enabled and visible at this scanline (WX is the position plus 7)
+    if (GET_BIT(reg[REG_LCDC], LCDC_W_ENABLE) && wy <= y && wx < SCREEN_WIDTH + 7) {
         window_in_line = 1;
+        window_line++;
     }
 
+    // The cached tile data belongs to the previous line
+    tm_addr_prev = 0;
+    tile_index_prev = -1;
+
     for (u8 x = 0; x < SCREEN_WIDTH; x++) {
-        u8 col = x % 8;
+        u8 col = (x + sx) & 7;
+        u8 row = bg_row;
         u16 tm_addr; 
         u16 xpos, ypos;
         int tile_index;
         
         // Check whether to display the background or the window
-        if (window_in_line && x >= wx) {
+        if (window_in_line && x + 7 >= wx) {
             ypos = win_y;
-            xpos = ( (x - wx) & 0xFF) >> 3; // (x / 8);
+            xpos = ( (x + 7 - wx) & 0xFF) >> 3; // (x / 8);
             tm_addr = win_tm_area + ypos + xpos;
+            col = (x + 7 - wx) & 7;
+            row = win_row;
+            // Switching to the window row invalidates the cached tile data
+            if (x + 7 == wx) tile_index_prev = -1;
         }
         else {
             ypos = bg_y;
@@ -225,9 +426,70 @@ void draw_tiles(u8 y) {
         }
         color_index = (GET_BIT(byte2, 7 - col) << 1) | GET_BIT(byte1, 7 - col);
 
-        pixel_updated = set_pixel(x + y * SCREEN_WIDTH, color_index);
-        // Tell screen to redraw at the next step
-        if (!redraw_flag && pixel_updated) redraw_flag = 1;
+        line_index[x]  = color_index;
+        line_pixels[x] = bg_lut[color_index];
+    }
+}
+
+// Draws the Background & Window with the CGB map attributes from VRAM bank 1:
+// palette (bits 0-2), tile bank (3), flips (5, 6) and priority over objects (7)
+void draw_tiles_cgb(u8 y) {
+    u8  sx      = reg[REG_SCX];
+    u8  sy      = reg[REG_SCY];
+    u8  wx      = reg[REG_WX];
+    u8  wy      = reg[REG_WY];
+
+    u8  td_area_flag    = GET_BIT(reg[REG_LCDC], LCDC_BGW_TILEDATA_AREA);
+    u16 bg_tm_area      = GET_BIT(reg[REG_LCDC], LCDC_BG_TILEMAP_AREA) ? 0x1C00 : 0x1800;
+    u16 win_tm_area     = GET_BIT(reg[REG_LCDC], LCDC_W_TILEMAP_AREA) ? 0x1C00 : 0x1800;
+    u8  window_in_line  = GET_BIT(reg[REG_LCDC], LCDC_W_ENABLE) && wy <= y && wx < SCREEN_WIDTH + 7;
+
+    u16 bg_y    = ( ((y + sy) & 0xFF) >> 3) << 5;
+    u16 win_y   = (window_line >> 3) << 5;
+    u8  bg_row  = (y + sy) & 7;
+    u8  win_row = window_line & 7;
+
+    u16 tm_prev = 0xFFFF;
+    u8  byte1 = 0, byte2 = 0, attr = 0, flip_x = 0;
+    u32* colors = cgb_colors[0][0];
+
+    if (window_in_line) window_line++;
+
+    for (u8 x = 0; x < SCREEN_WIDTH; x++) {
+        u16 tm_addr;
+        u8  col, row;
+
+        if (window_in_line && x + 7 >= wx) {
+            tm_addr = win_tm_area + win_y + (((x + 7 - wx) & 0xFF) >> 3);
+            col = (x + 7 - wx) & 7;
+            row = win_row;
+            if (x + 7 == wx) tm_prev = 0xFFFF; // same map address, other row
+        }
+        else {
+            tm_addr = bg_tm_area + bg_y + (((x + sx) & 0xFF) >> 3);
+            col = (x + sx) & 7;
+            row = bg_row;
+        }
+
+        // New tile: its attributes, then the row of tile data from the bank they select
+        if (tm_addr != tm_prev) {
+            u8  tile = vram[tm_addr];
+            u16 td_addr = td_area_flag ? (tile * 16) : (0x1000 + (s8)tile * 16);
+
+            tm_prev = tm_addr;
+            attr    = vram[BANKSIZE_VRAM + tm_addr];
+            flip_x  = GET_BIT(attr, 5);
+            colors  = cgb_colors[0][attr & 7];
+            if (GET_BIT(attr, 6)) row = 7 - row;
+            td_addr += (GET_BIT(attr, 3) ? BANKSIZE_VRAM : 0) + row * 2;
+            byte1 = vram[td_addr];
+            byte2 = vram[td_addr + 1];
+        }
+        if (!flip_x) col = 7 - col;
+
+        line_index[x]    = (GET_BIT(byte2, col) << 1) | GET_BIT(byte1, col);
+        line_priority[x] = GET_BIT(attr, 7);
+        line_pixels[x]   = colors[line_index[x]];
     }
 }
 
@@ -236,16 +498,19 @@ void draw_sprites(u8 y) {
     u8 is_big = GET_BIT(lcdc, LCDC_OBJ_SZ); // 8x16 sprites
     u8 height = is_big ? 16 : 8;
 
-    // iterate through all sprites, draw if pixel intercects with our scanline
-    for (u8 spr = 0; spr < 40; spr++) {
+    u8 bg_priority = cgb_flag && GET_BIT(lcdc, LCDC_BGW_ENABLE); // CGB: LCDC bit 0 clear puts objects on top
+
+    // iterate through all sprites, draw if pixel intercects with our scanline.
+    // In CGB mode the lower OAM index wins, they are drawn last.
+    for (u8 i = 0; i < 40; i++) {
+        u8 spr          = cgb_flag ? 39 - i : i;
         u8 index        = spr << 2; // spr * 4
         u8 ypos         = oam[index    ];
         u8 xpos         = oam[index + 1];
         u8 tile_index   = oam[index + 2];
         u8 attr         = oam[index + 3];
-        u8 flip_x, flip_y;
-
-        u8 pixel_updated = 0;
+        u8 flip_x, flip_y, bg_over_obj;
+        u32* lut;
 
         u8 byte1, byte2;
         u8 color_index;
@@ -261,11 +526,18 @@ void draw_sprites(u8 y) {
 
         flip_x = GET_BIT(attr, OAM_X_FLIP);
         flip_y = GET_BIT(attr, OAM_Y_FLIP);
+        bg_over_obj = GET_BIT(attr, OAM_BG_OVER_OBJ);
+        lut = obj_lut[GET_BIT(attr, OAM_PALLETE_DMG)];
 
         if (flip_y) ty = height - ty;
         
         // get pixel info
         pixel_offset = (tile_index * 16) + (ty * 2); // each tile takes 16 bytes (8x8x2BPP), each row of pixels is 2 bytes (2BPP)
+        if (cgb_flag) {
+            lut = cgb_colors[1][attr & 7];
+            if (GET_BIT(attr, OAM_VRAM_BANK_CGB)) pixel_offset += BANKSIZE_VRAM;
+            bg_over_obj = bg_priority && bg_over_obj;
+        }
         byte1 = vram[pixel_offset];      // represents lsb of the color_index of each pixel
         byte2 = vram[pixel_offset + 1];  // represents msb of the color_index of each pixel
 
@@ -275,10 +547,10 @@ void draw_sprites(u8 y) {
 
             color_index = (GET_BIT(byte2, x) << 1) | GET_BIT(byte1, x);
             if (color_index == 0) continue; // white is transparent for sprites
-            pixel_updated = set_pixel(px + (y * SCREEN_WIDTH), color_index);
-            
-            // tell screen to redraw at the next step
-            if (!redraw_flag && pixel_updated) redraw_flag = 1;
+            if (bg_over_obj && line_index[px] != 0) continue; // BG colors 1-3 are drawn over the sprite
+            if (bg_priority && line_priority[px] && line_index[px] != 0) continue; // CGB tile priority
+
+            line_pixels[px] = lut[color_index];
         }
 
     }
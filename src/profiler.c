@@ -0,0 +1,340 @@
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TABLE_MIN_SIZE  1024
+#define SYMBOL_NAME_MAX 64
+
+// Guest code location, bank << 16 | address. Only ROMX (4000-7FFF) carries a bank.
+typedef u32 Location;
+
+typedef struct Frame {
+    Location    entry;  // function entry
+    u16         sp;     // SP after the return address was pushed
+} Frame;
+
+// A distinct call stack and how often it was sampled, frames live in stack_pool
+typedef struct StackEntry {
+    u64 hash;
+    u32 count;
+    u32 offset;
+    u32 depth;          // 0 = unused slot
+} StackEntry;
+
+typedef struct HotSpot {
+    Location    pc;
+    u32         count;  // 0 = unused slot
+} HotSpot;
+
+typedef struct Symbol {
+    Location    location;
+    char        name[SYMBOL_NAME_MAX];
+} Symbol;
+
+u8          profiling;
+u32         profile_interval;
+u64         sample_count;
+
+// Shadow call stack
+Frame       call_stack[PROFILER_MAX_DEPTH];
+u32         call_depth;
+u32         lost_calls;     // calls made past PROFILER_MAX_DEPTH, still to return
+
+StackEntry* stacks;
+u32         stacks_size;    // slots, power of two
+u32         stacks_used;
+Location*   stack_pool;
+u32         pool_size;
+u32         pool_used;
+
+HotSpot*    hot_spots;
+u32         hot_spots_size;
+u32         hot_spots_used;
+
+Symbol*     symbols;        // sorted by location
+u32         symbol_count;
+
+Location make_location(u16 addr, u16 bank)
+{
+    return (addr >= 0x4000 && addr < 0x8000) ? ((Location)bank << 16) | addr : addr;
+}
+
+u64 hash_frames(const Location* frames, u32 count)
+{
+    u64 hash = 0xCBF29CE484222325ULL; // FNV-1a
+    for (u32 i = 0; i < count; i++) {
+        hash ^= frames[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Symbols ------------------------------------------------------------
+
+int compare_symbols(const void* a, const void* b)
+{
+    Location x = ((const Symbol*)a)->location;
+    Location y = ((const Symbol*)b)->location;
+    return (x > y) - (x < y);
+}
+
+// RGBDS / no$gmb symbol file: "BB:AAAA Name" per line, ';' starts a comment
+int load_symbols(const char* path)
+{
+    FILE*   fp = fopen(path, "r");
+    char    line[256];
+    u32     capacity = 0;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned int bank, addr;
+        char name[SYMBOL_NAME_MAX];
+
+        if (line[0] == ';' || sscanf(line, "%x:%x %63s", &bank, &addr, name) != 3) continue;
+        if (symbol_count == capacity) {
+            Symbol* grown;
+            capacity = capacity ? capacity * 2 : 256;
+            grown = (Symbol*)realloc(symbols, capacity * sizeof(Symbol));
+            if (grown == NULL) {
+                fprintf(stderr, "Failed to allocate symbols\n");
+                fclose(fp);
+                return -1;
+            }
+            symbols = grown;
+        }
+        symbols[symbol_count].location = make_location((u16)addr, (u16)bank);
+        strcpy(symbols[symbol_count].name, name);
+        symbol_count++;
+    }
+    fclose(fp);
+    qsort(symbols, symbol_count, sizeof(Symbol), compare_symbols);
+    return 0;
+}
+
+// Nearest symbol at or below the location in the same bank, else BB:AAAA
+void format_location(Location loc, char* out, u32 size)
+{
+    u32 low = 0, high = symbol_count;
+
+    while (low < high) {
+        u32 mid = (low + high) / 2;
+        if (symbols[mid].location <= loc) low = mid + 1;
+        else high = mid;
+    }
+    if (low > 0 && (symbols[low - 1].location >> 16) == (loc >> 16)) {
+        const Symbol* s = &symbols[low - 1];
+        if (s->location == loc) snprintf(out, size, "%s", s->name);
+        else                    snprintf(out, size, "%s+0x%X", s->name, loc - s->location);
+    }
+    else snprintf(out, size, "%02X:%04X", loc >> 16, loc & 0xFFFF);
+}
+
+// Tables -------------------------------------------------------------
+
+int grow_stacks()
+{
+    u32         size = stacks_size ? stacks_size * 2 : TABLE_MIN_SIZE;
+    StackEntry* table = (StackEntry*)calloc(size, sizeof(StackEntry));
+
+    if (table == NULL) return -1;
+    for (u32 i = 0; i < stacks_size; i++) {
+        u32 slot;
+        if (stacks[i].depth == 0) continue;
+        for (slot = (u32)stacks[i].hash & (size - 1); table[slot].depth; slot = (slot + 1) & (size - 1));
+        table[slot] = stacks[i];
+    }
+    free(stacks);
+    stacks = table;
+    stacks_size = size;
+    return 0;
+}
+
+int grow_hot_spots()
+{
+    u32         size = hot_spots_size ? hot_spots_size * 2 : TABLE_MIN_SIZE;
+    HotSpot*    table = (HotSpot*)calloc(size, sizeof(HotSpot));
+
+    if (table == NULL) return -1;
+    for (u32 i = 0; i < hot_spots_size; i++) {
+        u32 slot;
+        if (hot_spots[i].count == 0) continue;
+        for (slot = (hot_spots[i].pc * 0x9E3779B1u) & (size - 1); table[slot].count; slot = (slot + 1) & (size - 1));
+        table[slot] = hot_spots[i];
+    }
+    free(hot_spots);
+    hot_spots = table;
+    hot_spots_size = size;
+    return 0;
+}
+
+void count_stack(const Location* frames, u32 count)
+{
+    u64 hash = hash_frames(frames, count);
+    u32 slot;
+
+    if (stacks_used * 2 >= stacks_size && grow_stacks() == -1) return;
+    for (slot = (u32)hash & (stacks_size - 1); stacks[slot].depth; slot = (slot + 1) & (stacks_size - 1)) {
+        StackEntry* e = &stacks[slot];
+        if (e->hash == hash && e->depth == count && memcmp(&stack_pool[e->offset], frames, count * sizeof(Location)) == 0) {
+            e->count++;
+            return;
+        }
+    }
+
+    // New stack, its frames go to the pool
+    if (pool_used + count > pool_size) {
+        u32         size = pool_size ? pool_size * 2 : TABLE_MIN_SIZE * 8;
+        Location*   grown;
+        while (size < pool_used + count) size *= 2;
+        grown = (Location*)realloc(stack_pool, size * sizeof(Location));
+        if (grown == NULL) return;
+        stack_pool = grown;
+        pool_size = size;
+    }
+    memcpy(&stack_pool[pool_used], frames, count * sizeof(Location));
+    stacks[slot].hash = hash;
+    stacks[slot].count = 1;
+    stacks[slot].offset = pool_used;
+    stacks[slot].depth = count;
+    pool_used += count;
+    stacks_used++;
+}
+
+void count_hot_spot(Location pc)
+{
+    u32 slot;
+
+    if (hot_spots_used * 2 >= hot_spots_size && grow_hot_spots() == -1) return;
+    for (slot = (pc * 0x9E3779B1u) & (hot_spots_size - 1); hot_spots[slot].count; slot = (slot + 1) & (hot_spots_size - 1)) {
+        if (hot_spots[slot].pc == pc) {
+            hot_spots[slot].count++;
+            return;
+        }
+    }
+    hot_spots[slot].pc = pc;
+    hot_spots[slot].count = 1;
+    hot_spots_used++;
+}
+
+// API ----------------------------------------------------------------
+
+int profiler_start(u32 sample_interval, const char* sym_path)
+{
+    profiler_stop();
+    if (sym_path && load_symbols(sym_path) == -1) return -1;
+    if (grow_stacks() == -1 || grow_hot_spots() == -1) {
+        fprintf(stderr, "Failed to allocate the profiler tables\n");
+        profiler_stop();
+        return -1;
+    }
+    profile_interval = sample_interval ? sample_interval : PROFILER_DEFAULT_INTERVAL;
+    profiling = 1;
+    return 0;
+}
+
+void profiler_stop()
+{
+    free(stacks);
+    free(stack_pool);
+    free(hot_spots);
+    free(symbols);
+    stacks = NULL;
+    stack_pool = NULL;
+    hot_spots = NULL;
+    symbols = NULL;
+    stacks_size = stacks_used = pool_size = pool_used = 0;
+    hot_spots_size = hot_spots_used = 0;
+    symbol_count = 0;
+    call_depth = lost_calls = 0;
+    sample_count = 0;
+    profiling = 0;
+}
+
+u32 profiler_interval()
+{
+    return profiling ? profile_interval : 0;
+}
+
+void profiler_sample(u16 pc, u16 bank)
+{
+    Location frames[PROFILER_MAX_DEPTH + 1];
+
+    // Everything runs under the cartridge entry point
+    frames[0] = make_location(0x0100, 0);
+    for (u32 i = 0; i < call_depth; i++) frames[i + 1] = call_stack[i].entry;
+    count_stack(frames, call_depth + 1);
+    count_hot_spot(make_location(pc, bank));
+    sample_count++;
+}
+
+void profiler_call(u16 target, u16 bank, u16 sp)
+{
+    if (call_depth == PROFILER_MAX_DEPTH) {
+        lost_calls++;
+        return;
+    }
+    call_stack[call_depth].entry = make_location(target, bank);
+    call_stack[call_depth].sp = sp;
+    call_depth++;
+}
+
+// Unwinds every frame whose return address lies below the new SP. Returns through
+// a pushed address (PUSH + RET used as a jump) leave the stack as it was.
+void profiler_return(u16 sp)
+{
+    if (lost_calls) {
+        lost_calls--;
+        return;
+    }
+    while (call_depth > 0 && call_stack[call_depth - 1].sp < sp) call_depth--;
+}
+
+int compare_hot_spots(const void* a, const void* b)
+{
+    u32 x = ((const HotSpot*)a)->count;
+    u32 y = ((const HotSpot*)b)->count;
+    return (x < y) - (x > y);
+}
+
+// Writes the folded stacks and prints the hot spots
+int profiler_save(const char* path)
+{
+    FILE*   fp;
+    char    name[SYMBOL_NAME_MAX + 16];
+    u32     shown = 0;
+
+    if (!profiling) return -1;
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        return -1;
+    }
+    for (u32 i = 0; i < stacks_size; i++) {
+        const StackEntry* e = &stacks[i];
+        if (e->depth == 0) continue;
+        for (u32 f = 0; f < e->depth; f++) {
+            format_location(stack_pool[e->offset + f], name, sizeof(name));
+            fprintf(fp, f ? ";%s" : "%s", name);
+        }
+        fprintf(fp, " %u\n", e->count);
+    }
+    fclose(fp);
+
+    // Hot spots, sorted in place and then cleared since the slots no longer hash
+    qsort(hot_spots, hot_spots_size, sizeof(HotSpot), compare_hot_spots);
+    printf("Profile: %llu samples every %u dots, %u stacks written to %s\n", sample_count, profile_interval, stacks_used, path);
+    for (u32 i = 0; i < hot_spots_size && shown < PROFILER_HOT_SPOTS && hot_spots[i].count; i++, shown++) {
+        format_location(hot_spots[i].pc, name, sizeof(name));
+        printf("  %5.1f%%  %02X:%04X  %s\n", 100.0 * hot_spots[i].count / sample_count,
+            hot_spots[i].pc >> 16, hot_spots[i].pc & 0xFFFF, name);
+    }
+    memset(hot_spots, 0, hot_spots_size * sizeof(HotSpot));
+    hot_spots_used = 0;
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include "spsc_queue.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Initialize, capacity is rounded up to a power of 2 so indices can be masked
+int spsc_init(SPSCQueue* q, u32 elem_size, u32 capacity)
+{
+    u32 cap = 1;
+    while (cap < capacity) cap <<= 1;
+
+    q->data = (u8*)malloc((size_t)elem_size * cap);
+    if (q->data == NULL)
+    {
+        fprintf(stderr, "Failed to allocate memory for the queue!\n");
+        return -1;
+    }
+    q->elem_size = elem_size;
+    q->capacity = cap;
+    SDL_AtomicSet(&q->head, 0);
+    SDL_AtomicSet(&q->tail, 0);
+    return 0;
+}
+
+void spsc_cleanup(SPSCQueue* q)
+{
+    if (q->data) free(q->data);
+    q->data = NULL;
+}
+
+// Number of elements waiting to be popped
+u32 spsc_count(SPSCQueue* q)
+{
+    return (u32)SDL_AtomicGet(&q->tail) - (u32)SDL_AtomicGet(&q->head);
+}
+
+// Number of elements that can be pushed without overwriting
+u32 spsc_free(SPSCQueue* q)
+{
+    return q->capacity - spsc_count(q);
+}
+
+// Producer side. Returns 0 when the queue is full.
+int spsc_push(SPSCQueue* q, const void* elem)
+{
+    return spsc_push_n(q, elem, 1);
+}
+
+// Producer side. Pushes all elements or none, returns 0 when they don't fit.
+int spsc_push_n(SPSCQueue* q, const void* elems, u32 count)
+{
+    u32 tail = (u32)SDL_AtomicGet(&q->tail);
+    u32 head = (u32)SDL_AtomicGet(&q->head);
+    u32 mask = q->capacity - 1;
+    const u8* src = (const u8*)elems;
+
+    if (q->capacity - (tail - head) < count) return 0;
+
+    for (u32 i = 0; i < count; ) {
+        // Copy in up to 2 chunks, when wrapping around the end of the ring
+        u32 pos = (tail + i) & mask;
+        u32 n = q->capacity - pos;
+        if (n > count - i) n = count - i;
+        memcpy(q->data + (size_t)pos * q->elem_size, src + (size_t)i * q->elem_size, (size_t)n * q->elem_size);
+        i += n;
+    }
+    // Publish the data before moving the tail (SDL_AtomicSet is a full barrier)
+    SDL_AtomicSet(&q->tail, (int)(tail + count));
+    return 1;
+}
+
+// Consumer side. Returns 0 when the queue is empty.
+int spsc_pop(SPSCQueue* q, void* elem)
+{
+    return spsc_pop_n(q, elem, 1) == 1;
+}
+
+// Consumer side. Returns the amount of elements popped (up to count).
+u32 spsc_pop_n(SPSCQueue* q, void* elems, u32 count)
+{
+    u32 head = (u32)SDL_AtomicGet(&q->head);
+    u32 tail = (u32)SDL_AtomicGet(&q->tail);
+    u32 mask = q->capacity - 1;
+    u8* dst = (u8*)elems;
+
+    if (count > tail - head) count = tail - head;
+
+    for (u32 i = 0; i < count; ) {
+        u32 pos = (head + i) & mask;
+        u32 n = q->capacity - pos;
+        if (n > count - i) n = count - i;
+        memcpy(dst + (size_t)i * q->elem_size, q->data + (size_t)pos * q->elem_size, (size_t)n * q->elem_size);
+        i += n;
+    }
+    SDL_AtomicSet(&q->head, (int)(head + count));
+    return count;
+}
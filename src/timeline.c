@@ -0,0 +1,172 @@
+#include "timeline.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "spsc_queue.h"
+
+#define WRITE_CHUNK_EVENTS  1024
+
+typedef struct TimelineEvent {
+    u64         time;   // performance counter
+    const char* name;
+    u32         arg;    // instant events only
+    char        phase;  // 'B'egin, 'E'nd, 'i'nstant
+} TimelineEvent;
+
+const char* thread_names[TIMELINE_THREADS] = { "render", "emulation" };
+
+FILE*           timeline_file = NULL;
+SPSCQueue       timeline_queues[TIMELINE_THREADS];
+SDL_atomic_t    timeline_active;
+SDL_Thread*     timeline_writer = NULL;
+SDL_atomic_t    timeline_writer_running;
+u64             timeline_origin;    // performance counter at timeline_start
+u64             timeline_dropped[TIMELINE_THREADS];
+u64             timeline_written;
+
+// PRIVATE --------------------------------------------------
+
+void push_event(TimelineThread thread, const char* name, char phase, u32 arg)
+{
+    TimelineEvent e;
+
+    if (!SDL_AtomicGet(&timeline_active)) return;
+    e.time = SDL_GetPerformanceCounter();
+    e.name = name;
+    e.arg = arg;
+    e.phase = phase;
+    if (!spsc_push(&timeline_queues[thread], &e)) timeline_dropped[thread]++;
+}
+
+// Writes everything queued, returns the amount of events written
+u32 drain_timeline()
+{
+    static TimelineEvent    chunk[WRITE_CHUNK_EVENTS];
+    double                  us_per_tick = 1e6 / SDL_GetPerformanceFrequency();
+    u32                     n, total = 0;
+
+    for (u32 t = 0; t < TIMELINE_THREADS; t++) {
+        while ((n = spsc_pop_n(&timeline_queues[t], chunk, WRITE_CHUNK_EVENTS)) > 0) {
+            for (u32 i = 0; i < n; i++) {
+                const TimelineEvent* e = &chunk[i];
+                double ts = (double)(e->time - timeline_origin) * us_per_tick;
+                if (e->phase == 'i') {
+                    fprintf(timeline_file, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"value\":%u}}",
+                        e->name, ts, t, e->arg);
+                }
+                else {
+                    fprintf(timeline_file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+                        e->name, e->phase, ts, t);
+                }
+            }
+            total += n;
+        }
+    }
+    timeline_written += total;
+    return total;
+}
+
+int timeline_writer_thread(void* data)
+{
+    while (SDL_AtomicGet(&timeline_writer_running)) {
+        if (drain_timeline() == 0) SDL_Delay(10);
+    }
+    // The recording threads stopped before clearing timeline_writer_running
+    drain_timeline();
+    return 0;
+}
+
+// PUBLIC --------------------------------------------------
+
+// Opens the file and starts recording
+int timeline_start(const char* path)
+{
+    timeline_file = fopen(path, "w");
+    if (timeline_file == NULL)
+    {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        return -1;
+    }
+
+    for (u32 t = 0; t < TIMELINE_THREADS; t++) {
+        if (spsc_init(&timeline_queues[t], sizeof(TimelineEvent), TIMELINE_QUEUE_EVENTS) == -1)
+        {
+            while (t-- > 0) spsc_cleanup(&timeline_queues[t]);
+            fclose(timeline_file);
+            timeline_file = NULL;
+            return -1;
+        }
+        timeline_dropped[t] = 0;
+    }
+    timeline_written = 0;
+    timeline_origin = SDL_GetPerformanceCounter();
+
+    // Thread names first, every event after them starts with a comma
+    fprintf(timeline_file, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"AluBoy\"}}");
+    for (u32 t = 0; t < TIMELINE_THREADS; t++) {
+        fprintf(timeline_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+            t, thread_names[t]);
+    }
+
+    SDL_AtomicSet(&timeline_writer_running, 1);
+    timeline_writer = SDL_CreateThread(timeline_writer_thread, "timeline writer", NULL);
+    if (timeline_writer == NULL)
+    {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        for (u32 t = 0; t < TIMELINE_THREADS; t++) spsc_cleanup(&timeline_queues[t]);
+        fclose(timeline_file);
+        timeline_file = NULL;
+        return -1;
+    }
+    SDL_AtomicSet(&timeline_active, 1);
+    return 0;
+}
+
+// Call once the recording threads are done, flushes and closes the file
+void timeline_stop()
+{
+    if (timeline_file == NULL) return;
+
+    SDL_AtomicSet(&timeline_active, 0);
+    SDL_AtomicSet(&timeline_writer_running, 0);
+    SDL_WaitThread(timeline_writer, NULL);
+    timeline_writer = NULL;
+
+    fprintf(timeline_file, "\n]}\n");
+    fclose(timeline_file);
+    timeline_file = NULL;
+    for (u32 t = 0; t < TIMELINE_THREADS; t++) spsc_cleanup(&timeline_queues[t]);
+
+    printf("Timeline: %llu events written, %llu dropped\n",
+        timeline_written, timeline_dropped[TIMELINE_RENDER] + timeline_dropped[TIMELINE_EMULATION]);
+}
+
+// Pauses or resumes recording, only while a timeline is open
+void timeline_set_recording(u8 on)
+{
+    if (timeline_file == NULL) return;
+    SDL_AtomicSet(&timeline_active, on);
+    printf("Timeline recording %s\n", on ? "resumed" : "paused");
+}
+
+u8 timeline_recording()
+{
+    return SDL_AtomicGet(&timeline_active) != 0;
+}
+
+void timeline_begin(TimelineThread thread, const char* name)
+{
+    push_event(thread, name, 'B', 0);
+}
+
+void timeline_end(TimelineThread thread, const char* name)
+{
+    push_event(thread, name, 'E', 0);
+}
+
+void timeline_instant(TimelineThread thread, const char* name, u32 arg)
+{
+    push_event(thread, name, 'i', arg);
+}
@@ -0,0 +1,155 @@
+#include "timer.h"
+
+#include "emu_shared.h"
+
+// TIMA counts the falling edges of this system counter bit, per TAC bits 0-1
+const u8 tac_bits[4] = { 9, 3, 5, 7 };
+
+u64 div_anchor;     // dot at which the 16-bit system counter was 0, DIV is its upper byte
+u8  speed_shift;    // 1 in double speed, the counter then runs at 2 per dot
+u64 tima_time;      // dot at which TIMA was tima_base
+u8  tima_base;
+u64 overflow_time;  // dot of the next TIMA overflow, CYCLES_NEVER when stopped
+
+// PRIVATE --------------------------------------------------
+
+// System counter without wrapping
+u64 sys_counter(u64 now)
+{
+    return (now - div_anchor) << speed_shift;
+}
+
+u8 timer_enabled()
+{
+    return GET_BIT(reg[REG_TAC], 2);
+}
+
+// AND of the enable bit and the selected counter bit. TIMA ticks when it falls.
+u8 timer_signal(u64 now)
+{
+    return timer_enabled() && ((sys_counter(now) >> tac_bits[reg[REG_TAC] & 0x3]) & 1);
+}
+
+// Falling edges of the selected bit in (from, to]
+u64 tima_edges(u64 from, u64 to)
+{
+    u8 shift = tac_bits[reg[REG_TAC] & 0x3] + 1;
+    return (sys_counter(to) >> shift) - (sys_counter(from) >> shift);
+}
+
+// Folds the edges up to now into tima_base
+void sync_tima(u64 now)
+{
+    if (timer_enabled()) tima_base = (u8)(tima_base + tima_edges(tima_time, now));
+    tima_time = now;
+}
+
+// An edge outside the regular count (DIV reset, TAC change)
+void tima_increment()
+{
+    if (++tima_base == 0) {
+        tima_base = reg[REG_TMA];
+        SET_BIT(reg[REG_IF], INT_BIT_TIMER);
+    }
+}
+
+void schedule_overflow()
+{
+    u8 shift;
+
+    if (!timer_enabled()) {
+        overflow_time = CYCLES_NEVER;
+        return;
+    }
+    // The (256 - TIMA)th edge after tima_time
+    shift = tac_bits[reg[REG_TAC] & 0x3] + 1;
+    overflow_time = div_anchor + ((((sys_counter(tima_time) >> shift) + (256 - tima_base)) << shift) >> speed_shift);
+}
+
+// PUBLIC --------------------------------------------------
+
+// Syncs with the register values set on power up
+void timer_reset(u64 now)
+{
+    speed_shift = 0;
+    div_anchor = now - ((u64)reg[REG_DIV] << 8);
+    tima_base = reg[REG_TIMA];
+    tima_time = now;
+    schedule_overflow();
+}
+
+u8 timer_read(u8 addr, u64 now)
+{
+    switch (addr) {
+        case REG_DIV:
+            return (sys_counter(now) >> 8) & 0xFF;
+        case REG_TIMA:
+            return timer_enabled() ? (u8)(tima_base + tima_edges(tima_time, now)) : tima_base;
+        case REG_TAC:
+            return reg[REG_TAC] | 0xF8;
+    }
+    return reg[addr];
+}
+
+void timer_write(u8 addr, u8 value, u64 now)
+{
+    u8 signal;
+
+    switch (addr) {
+        case REG_DIV:
+            // Resetting the counter is a falling edge when the selected bit was set
+            sync_tima(now);
+            if (timer_signal(now)) tima_increment();
+            div_anchor = now;
+            break;
+        case REG_TIMA:
+            sync_tima(now);
+            tima_base = value;
+            break;
+        case REG_TMA:
+            // Only used on reloads
+            reg[REG_TMA] = value;
+            break;
+        case REG_TAC:
+            // Disabling the timer or switching to a cleared bit can be a falling edge too
+            signal = timer_signal(now);
+            sync_tima(now);
+            reg[REG_TAC] = value;
+            if (signal && !timer_signal(now)) tima_increment();
+            break;
+    }
+    schedule_overflow();
+}
+
+// The counter keeps its value across a speed switch, only its rate changes
+void timer_set_speed(u8 double_speed, u64 now)
+{
+    u64 counter = sys_counter(now);
+
+    sync_tima(now);
+    speed_shift = double_speed;
+    div_anchor = now - (counter >> speed_shift);
+    tima_time = now;
+    schedule_overflow();
+}
+
+// The 16-bit system counter, DIV is its upper byte
+u16 timer_counter(u64 now)
+{
+    return (u16)sys_counter(now);
+}
+
+u64 timer_next_overflow()
+{
+    return overflow_time;
+}
+
+// Called once the master clock reaches timer_next_overflow. TIMA is reloaded from TMA
+// at the overflowing edge and counts on from there.
+void timer_overflow()
+{
+    tima_base = reg[REG_TMA];
+    tima_time = overflow_time;
+    SET_BIT(reg[REG_IF], INT_BIT_TIMER);
+    schedule_overflow();
+}
@@ -0,0 +1,79 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+TraceRecord*    trace_ring = NULL;
+u32             trace_mask;
+u64             trace_head;     // records written since trace_start
+
+// Allocates the ring, capacity is rounded up to a power of two
+int trace_start(u32 capacity)
+{
+    u32 size = 1;
+
+    if (capacity == 0) capacity = TRACE_DEFAULT_SIZE;
+    while (size < capacity && size < 0x80000000) size <<= 1;
+
+    trace_stop();
+    trace_ring = (TraceRecord*)calloc(size, sizeof(TraceRecord));
+    if (trace_ring == NULL) {
+        fprintf(stderr, "Failed to allocate the trace buffer (%u records)\n", size);
+        return -1;
+    }
+    trace_mask = size - 1;
+    trace_head = 0;
+    return 0;
+}
+
+void trace_stop()
+{
+    if (trace_ring) free(trace_ring);
+    trace_ring = NULL;
+}
+
+// Records currently held in the ring
+u64 trace_count()
+{
+    if (trace_ring == NULL) return 0;
+    return trace_head < (u64)trace_mask + 1 ? trace_head : (u64)trace_mask + 1;
+}
+
+int trace_save(const char* path)
+{
+    FILE*       fp;
+    TraceHeader header;
+    u64         count = trace_count();
+    u64         first = trace_head - count;
+    u32         start = (u32)(first & trace_mask);
+    u32         part;
+
+    if (trace_ring == NULL) return -1;
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "ATRC", 4);
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    header.count = count;
+
+    // The oldest record sits at the write position once the ring wrapped
+    part = (u32)((u64)trace_mask + 1 - start < count ? (u64)trace_mask + 1 - start : count);
+    if (fwrite(&header, sizeof(header), 1, fp) != 1
+        || fwrite(&trace_ring[start], sizeof(TraceRecord), part, fp) != part
+        || fwrite(trace_ring, sizeof(TraceRecord), (size_t)(count - part), fp) != count - part)
+    {
+        fprintf(stderr, "Failed to write file: %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    printf("Trace: %llu instructions written to %s\n", count, path);
+    return 0;
+}
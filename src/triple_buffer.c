@@ -0,0 +1,73 @@
+#include "triple_buffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TB_FRESH_BIT 0x4
+#define TB_INDEX_MASK 0x3
+
+int triple_buffer_init(TripleBuffer* tb, u32 size)
+{
+    for (u8 i = 0; i < 3; i++) {
+        tb->buffers[i] = (u8*)calloc(size, sizeof(u8));
+        tb->cycles[i] = 0;
+        if (tb->buffers[i] == NULL)
+        {
+            fprintf(stderr, "Failed to allocate memory for the triple buffer!\n");
+            return -1;
+        }
+    }
+    tb->size = size;
+    tb->write_index = 0;
+    tb->read_index = 1;
+    SDL_AtomicSet(&tb->state, 2); // buffer 2 is the ready one, nothing published yet
+    return 0;
+}
+
+void triple_buffer_cleanup(TripleBuffer* tb)
+{
+    for (u8 i = 0; i < 3; i++) {
+        if (tb->buffers[i]) free(tb->buffers[i]);
+        tb->buffers[i] = NULL;
+    }
+}
+
+// Producer side. The buffer to write the next frame into.
+u8* triple_buffer_write_ptr(TripleBuffer* tb)
+{
+    return tb->buffers[tb->write_index];
+}
+
+// Producer side. Swaps the written buffer with the ready one, never blocks.
+void triple_buffer_publish(TripleBuffer* tb, u64 cycle)
+{
+    int prev;
+
+    tb->cycles[tb->write_index] = cycle;
+    // SDL_AtomicSet returns the previous value, which makes it an atomic exchange
+    prev = SDL_AtomicSet(&tb->state, tb->write_index | TB_FRESH_BIT);
+    tb->write_index = prev & TB_INDEX_MASK;
+}
+
+// Consumer side. Returns 1 and takes the ready buffer if a new frame was published since the last call.
+int triple_buffer_consume(TripleBuffer* tb)
+{
+    int prev;
+
+    if (!(SDL_AtomicGet(&tb->state) & TB_FRESH_BIT)) return 0;
+
+    prev = SDL_AtomicSet(&tb->state, tb->read_index);
+    tb->read_index = prev & TB_INDEX_MASK;
+    return 1;
+}
+
+// Consumer side. The most recently consumed frame.
+u8* triple_buffer_read_ptr(TripleBuffer* tb)
+{
+    return tb->buffers[tb->read_index];
+}
+
+u64 triple_buffer_read_cycle(TripleBuffer* tb)
+{
+    return tb->cycles[tb->read_index];
+}
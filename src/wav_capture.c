@@ -0,0 +1,174 @@
+#include "wav_capture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+
+#include "spsc_queue.h"
+
+#define WRITE_CHUNK_FRAMES  4096
+#define WAV_HEADER_SIZE     44
+
+FILE*           capture_file = NULL;
+u8              capture_raw;        // headerless s16 stereo PCM
+int             capture_rate;
+u8              write_error;
+SPSCQueue       capture_queue;
+SDL_Thread*     writer = NULL;
+SDL_sem*        writer_wake = NULL;
+SDL_atomic_t    writer_running;
+
+u64             pushed_frames;      // emulation thread
+u64             written_frames;     // writer thread
+DropEvent       drops[CAPTURE_MAX_DROP_EVENTS];
+u32             drop_count;
+u64             dropped_frames;
+
+// PRIVATE --------------------------------------------------
+
+void put_u16(u8* p, u16 v) { p[0] = v & 0xFF; p[1] = v >> 8; }
+void put_u32(u8* p, u32 v) { put_u16(p, v & 0xFFFF); put_u16(p + 2, v >> 16); }
+
+// 16-bit stereo PCM header, the sizes are patched when the capture stops
+void write_wav_header(int sample_rate, u32 data_bytes)
+{
+    u8 h[WAV_HEADER_SIZE];
+
+    memcpy(h, "RIFF", 4);
+    put_u32(h + 4, 36 + data_bytes);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_u32(h + 16, 16);                // fmt chunk size
+    put_u16(h + 20, 1);                 // PCM
+    put_u16(h + 22, 2);                 // channels
+    put_u32(h + 24, sample_rate);
+    put_u32(h + 28, sample_rate * 4);   // byte rate
+    put_u16(h + 32, 4);                 // block align
+    put_u16(h + 34, 16);                // bits per sample
+    memcpy(h + 36, "data", 4);
+    put_u32(h + 40, data_bytes);
+
+    fseek(capture_file, 0, SEEK_SET);
+    fwrite(h, 1, WAV_HEADER_SIZE, capture_file);
+}
+
+// Writes everything queued, returns the amount of sample pairs written
+u32 drain_queue()
+{
+    static s16  chunk[WRITE_CHUNK_FRAMES * 2];
+    u32         n, total = 0;
+
+    while ((n = spsc_pop_n(&capture_queue, chunk, WRITE_CHUNK_FRAMES)) > 0) {
+        if (!write_error && fwrite(chunk, 2 * sizeof(s16), n, capture_file) != n) {
+            perror("Audio capture: ");
+            write_error = 1;
+        }
+        total += n;
+    }
+    written_frames += total;
+    return total;
+}
+
+int writer_thread(void* data)
+{
+    while (SDL_AtomicGet(&writer_running)) {
+        if (drain_queue() == 0) SDL_SemWaitTimeout(writer_wake, 10);
+    }
+    // The emulation thread stopped pushing before clearing writer_running
+    drain_queue();
+    return 0;
+}
+
+// PUBLIC --------------------------------------------------
+
+// Starts writing to path, as WAV unless it ends in ".raw"
+int wav_capture_start(const char* path, int sample_rate)
+{
+    size_t len = strlen(path);
+
+    capture_raw = len >= 4 && strcmp(path + len - 4, ".raw") == 0;
+    capture_file = fopen(path, "wb");
+    if (capture_file == NULL)
+    {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        perror("Error: ");
+        return -1;
+    }
+    capture_rate = sample_rate;
+    if (!capture_raw) write_wav_header(capture_rate, 0);
+
+    if (spsc_init(&capture_queue, 2 * sizeof(s16), CAPTURE_QUEUE_FRAMES) == -1)
+    {
+        fclose(capture_file);
+        capture_file = NULL;
+        return -1;
+    }
+
+    write_error = 0;
+    pushed_frames = 0;
+    written_frames = 0;
+    drop_count = 0;
+    dropped_frames = 0;
+
+    writer_wake = SDL_CreateSemaphore(0);
+    SDL_AtomicSet(&writer_running, 1);
+    writer = writer_wake ? SDL_CreateThread(writer_thread, "wav writer", NULL) : NULL;
+    if (writer == NULL)
+    {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        if (writer_wake) SDL_DestroySemaphore(writer_wake);
+        writer_wake = NULL;
+        spsc_cleanup(&capture_queue);
+        fclose(capture_file);
+        capture_file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Flushes the queue, finalizes the header and reports the drops
+void wav_capture_stop()
+{
+    if (capture_file == NULL) return;
+
+    SDL_AtomicSet(&writer_running, 0);
+    SDL_SemPost(writer_wake);
+    SDL_WaitThread(writer, NULL);
+    writer = NULL;
+    SDL_DestroySemaphore(writer_wake);
+    writer_wake = NULL;
+
+    if (!capture_raw) write_wav_header(capture_rate, (u32)(written_frames * 4));
+    fclose(capture_file);
+    capture_file = NULL;
+    spsc_cleanup(&capture_queue);
+
+    printf("Audio capture: %llu sample pairs written, %llu dropped in %u events\n",
+        written_frames, dropped_frames, drop_count);
+    for (u32 i = 0; i < drop_count && i < CAPTURE_MAX_DROP_EVENTS; i++) {
+        printf("  dropped %u at %llu\n", drops[i].count, drops[i].position);
+    }
+}
+
+u8 wav_capture_active()
+{
+    return capture_file != NULL;
+}
+
+// Emulation thread. Never blocks, samples that don't fit are dropped and recorded.
+void wav_capture_push(const s16* samples, int count)
+{
+    if (capture_file == NULL || count <= 0) return;
+
+    if (spsc_push_n(&capture_queue, samples, count)) {
+        pushed_frames += count;
+        SDL_SemPost(writer_wake);
+        return;
+    }
+    // A gap in the stream, logged with where it happened
+    if (drop_count < CAPTURE_MAX_DROP_EVENTS) {
+        drops[drop_count].position = pushed_frames + dropped_frames;
+        drops[drop_count].count = count;
+    }
+    drop_count++;
+    dropped_frames += count;
+}
@@ -1,2 +1,5 @@
 //#include "test_string.c"
-#include "test_cpu.c"
\ No newline at end of file
+#include "test_cpu.c"
+#include "test_timer.c"
+#include "test_apu.c"
+#include "test_ppu.c"
\ No newline at end of file
@@ -0,0 +1,74 @@
+#if defined HEADERS
+
+// Runs on the core from test_cpu.c. Resets DIV and power cycles the APU so the frame
+// sequencer is at step 0, then triggers channel 1. Every write takes one M-cycle,
+// the system counter is at 32 when this returns.
+void apu_test_start(u8 nr10, u8 nr11, u16 freq)
+{
+    test_power_up();
+    write(0xFF00 | REG_DIV, 0);
+    write(0xFF00 | REG_NR52, 0x00);
+    write(0xFF00 | REG_NR52, 0x80);
+    write(0xFF00 | REG_NR10, nr10);
+    write(0xFF00 | REG_NR11, nr11);
+    write(0xFF00 | REG_NR12, 0xF0);
+    write(0xFF00 | REG_NR13, freq & 0xFF);
+    write(0xFF00 | REG_NR14, 0xC0 | (freq >> 8));
+}
+
+u8 apu_test_ch1_on()
+{
+    return GET_BIT(read(0xFF26), 0);
+}
+
+#elif defined TESTS
+
+TEST("length counters are clocked on the even sequencer steps") {
+    // Length 2: steps 0 and 2, when DIV bit 4 falls at 8192 and 24576
+    apu_test_start(0x00, 0x3E, 0x400);
+    ASSERT(apu_test_ch1_on());
+    test_run_dots(24576 - 32 - 4);
+    ASSERT(apu_test_ch1_on());
+    test_run_dots(4);
+    ASSERT(!apu_test_ch1_on());
+}
+TEST("sweep overflow disables channel 1 on step 2") {
+    // 0x400 + (0x400 >> 1) fits, the check after it (0x600 + 0x300) overflows
+    apu_test_start(0x11, 0x00, 0x400);
+    ASSERT(apu_test_ch1_on());
+    test_run_dots(24576 - 32 - 4);
+    ASSERT(apu_test_ch1_on());
+    test_run_dots(4);
+    ASSERT(!apu_test_ch1_on());
+}
+TEST("writing div while its bit 4 is set clocks the sequencer") {
+    apu_test_start(0x00, 0x3F, 0x400);
+    test_run_dots(4096 - 32);
+    write(0xFF04, 0);
+    ASSERT(!apu_test_ch1_on());
+
+    apu_test_start(0x00, 0x3F, 0x400);
+    test_run_dots(4096 - 32 - 4);
+    write(0xFF04, 0);
+    ASSERT(apu_test_ch1_on());
+    test_run_dots(8192 - 8);
+    ASSERT(apu_test_ch1_on());
+    test_run_dots(4);
+    ASSERT(!apu_test_ch1_on());
+}
+TEST("the sequencer follows div bit 5 after a speed switch") {
+    // Step 0 at 8192. The switch at 12288 resets DIV with bit 4 set, which is step 1.
+    // A DIV write with only bit 4 set is no step in double speed, bit 5 falls
+    // (step 2) once the counter reaches 16384 again, 8190 dots after that write.
+    apu_test_start(0x00, 0x3E, 0x400);
+    test_run_dots(12288 - 32);
+    switch_speed();
+    test_run_dots(2048);
+    write(0xFF04, 0);
+    test_run_dots(8190 - 2);
+    ASSERT(apu_test_ch1_on());
+    test_run_dots(2);
+    ASSERT(!apu_test_ch1_on());
+}
+
+#endif
\ No newline at end of file
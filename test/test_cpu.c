@@ -1,6 +1,72 @@
 #if defined HEADERS
 
-#include "..\src\emu_cpu.c"
+#include <SDL.h>
+
+#include "../src/cpu.c"
+#include "../src/ppu.c"
+#include "../src/apu.c"
+#include "../src/blip.c"
+#include "../src/timer.c"
+#include "../src/trace.c"
+#include "../src/profiler.c"
+#include "../src/spsc_queue.c"
+#include "../src/timeline.c"
+
+u8 blank_rom[0x8000];
+
+// Powers up on a blank 32 KB cartridge, marked CGB enhanced (0x143 = 0x80) if cgb is set.
+// The header is only read again when the model changes, otherwise the registers are reset.
+void test_power_up_model(u8 cgb)
+{
+    static u8 initialized;
+
+    if (initialized && cgb_flag == cgb) power_up();
+    else {
+        blank_rom[ROM_CGB_FLAG] = cgb ? 0x80 : 0x00;
+        if (!initialized) initialized = (apu_init(APU_SAMPLE_RATE) == 0 && ppu_init() == 0);
+        cpu_init(blank_rom);
+    }
+    apu_set_synthesis(0, cycles_total);
+}
+
+void test_power_up()
+{
+    test_power_up_model(0);
+}
+
+// Copies a program to the start of WRAM (C000) and points PC at it
+void test_load_program(const u8* code, u16 size)
+{
+    memcpy(wram, code, size);
+    PC = 0xC000;
+}
+
+// Points the VRAM DMA at C000 -> 8000, over a pattern of 0x40 bytes
+void vram_dma_test_start()
+{
+    test_power_up_model(1);
+    for (u8 i = 0; i < 0x40; i++) wram[i] = i + 1;
+    memset(vram, 0, 0x40);
+    write(0xFF51, 0xC0);
+    write(0xFF52, 0x00);
+    write(0xFF53, 0x80);
+    write(0xFF54, 0x00);
+}
+
+// Starts an OAM DMA from C000 over a pattern. The write takes an M-cycle, so the
+// transfer is at byte 1 when this returns.
+void oam_dma_test_start()
+{
+    test_power_up();
+    for (u8 i = 0; i < 0xA0; i++) wram[i] = i + 1;
+    write(0xFF46, 0xC0);
+}
+
+// Advances the master clock by whole M-cycles
+void test_run_dots(u32 dots)
+{
+    for (u32 i = 0; i < dots; i += tick_dots) tick();
+}
 
 #elif defined TESTS
 
@@ -28,5 +94,197 @@ TEST("enable ram in mbc5") {
     ASSERT(eram_enabled);
     eram_enabled = 0;
 }
+TEST("power up leaves the dmg registers") {
+    test_power_up_model(0);
+    ASSERT(A == 0x01);
+    ASSERT(BC.full == 0x0013 && DE.full == 0x00D8 && HL.full == 0x014D);
+}
+TEST("power up leaves the cgb registers on cgb cartridges") {
+    test_power_up_model(1);
+    ASSERT(A == 0x11);
+    ASSERT(F_Z && !F_N && !F_H && !F_C);
+    ASSERT(BC.full == 0x0000 && DE.full == 0xFF56 && HL.full == 0x000D);
+}
+TEST("ignored eram writes still take their m-cycle") {
+    const u8 program[] = { 0x77, 0x77 }; // LD (HL),A twice
+    u64 start;
+
+    test_power_up();
+    test_load_program(program, sizeof(program));
+    HL.full = 0xA000;
+    start = cycles_total;
+    cpu_step();
+    ASSERT(cycles_total - start == 8);
+    HL.full = 0xC100;
+    start = cycles_total;
+    cpu_step();
+    ASSERT(cycles_total - start == 8);
+}
+TEST("gb_run_cycles stops at the first instruction boundary past the target") {
+    const u8 program[] = { 0x18, 0xFE }; // JR -2, 12 dots
+    u64 start;
+
+    test_power_up();
+    test_load_program(program, sizeof(program));
+    start = cycles_total;
+    gb_run_cycles(100);
+    ASSERT(cycles_total - start == 108);
+    start = cycles_total;
+    gb_run_cycles(0);
+    ASSERT(cycles_total == start);
+}
+TEST("gb_run_until_vblank stops on the instruction that reaches ly 144") {
+    const u8 program[] = { 0x18, 0xFE };
+    u64 start;
+
+    test_power_up();
+    test_load_program(program, sizeof(program));
+    gb_run_until_vblank();
+    ASSERT(reg[REG_LY] == 144);
+    ASSERT(scanline_counter <= 12);
+    start = cycles_total;
+    gb_run_until_vblank();
+    ASSERT(reg[REG_LY] == 144);
+    ASSERT(cycles_total - start > MAXDOTS - 12 && cycles_total - start < MAXDOTS + 12);
+}
+TEST("gb_run_until_vblank runs at most a frame while the lcd is off") {
+    const u8 program[] = { 0x18, 0xFE };
+    u64 start;
+
+    test_power_up();
+    test_load_program(program, sizeof(program));
+    reg[REG_LCDC] = 0x11;
+    start = cycles_total;
+    gb_run_until_vblank();
+    ASSERT(cycles_total - start >= MAXDOTS && cycles_total - start < MAXDOTS + 12);
+    ASSERT(reg[REG_LY] == 0);
+}
+TEST("general purpose vram dma copies the blocks and stalls 8 m-cycles per block") {
+    vram_dma_test_start();
+    write(0xFF55, 0x01);
+    ASSERT(stall_cycles == 16);
+    ASSERT(read(0xFF55) == 0xFF);
+    ASSERT(memcmp(vram, wram, 0x20) == 0 && vram[0x20] == 0);
+}
+TEST("general purpose vram dma stalls 16 m-cycles per block in double speed") {
+    vram_dma_test_start();
+    switch_speed();
+    stall_cycles = 0;
+    write(0xFF55, 0x01);
+    ASSERT(stall_cycles == 32);
+    ASSERT(memcmp(vram, wram, 0x20) == 0);
+}
+TEST("hblank vram dma copies a block per hblank and counts hdma5 down") {
+    vram_dma_test_start();
+    write(0xFF55, 0x82);
+    ASSERT(read(0xFF55) == 0x02);
+    ASSERT(vram[0] == 0);
+    cpu_hblank();
+    ASSERT(read(0xFF55) == 0x01);
+    ASSERT(memcmp(vram, wram, 0x10) == 0 && vram[0x10] == 0);
+    cpu_hblank();
+    ASSERT(read(0xFF55) == 0x00);
+    cpu_hblank();
+    ASSERT(read(0xFF55) == 0xFF);
+    ASSERT(!hdma_active);
+    ASSERT(memcmp(vram, wram, 0x30) == 0 && vram[0x30] == 0);
+    cpu_hblank();
+    ASSERT(vram[0x30] == 0);
+}
+TEST("clearing bit 7 of hdma5 cancels an hblank vram dma") {
+    vram_dma_test_start();
+    write(0xFF55, 0x83);
+    cpu_hblank();
+    write(0xFF55, 0x00);
+    ASSERT(!hdma_active);
+    ASSERT(read(0xFF55) == 0x82);
+    cpu_hblank();
+    ASSERT(vram[0x10] == 0);
+}
+TEST("svbk maps wram banks 1-7 at d000, 0 maps bank 1") {
+    test_power_up_model(1);
+    write(0xFF70, 0x01);
+    write(0xD000, 0x11);
+    write(0xFF70, 0x02);
+    write(0xD000, 0x22);
+    ASSERT(wram[0x1000] == 0x11 && wram[0x2000] == 0x22);
+    write(0xFF70, 0x00);
+    ASSERT(read(0xD000) == 0x11);
+    write(0xFF70, 0xFA);
+    ASSERT(read(0xD000) == 0x22);
+    ASSERT(*vram_dma_source(0xD000) == 0x22);
+    write(0xFF70, 0xF8);
+    ASSERT(*vram_dma_source(0xD000) == 0x11);
+}
+TEST("key1 and stop switch the speed") {
+    const u8 program[] = { 0x10, 0x10 }; // STOP, STOP
+    u64 start;
+
+    test_power_up_model(1);
+    test_load_program(program, sizeof(program));
+    write(0xFF4D, 0x01);
+    ASSERT(read(0xFF4D) == 0x7F);
+    cpu_step();
+    ASSERT(read(0xFF4D) == 0xFE);
+    ASSERT(tick_dots == 2);
+    ASSERT(stall_cycles == 2050);
+    start = cycles_total;
+    cpu_step();
+    ASSERT(cycles_total - start == 2050 * 2);
+    write(0xFF4D, 0x01);
+    cpu_step();
+    ASSERT(read(0xFF4D) == 0x7E);
+    ASSERT(tick_dots == 4);
+}
+TEST("a running oam dma keeps its progress across a speed switch") {
+    test_power_up_model(1);
+    for (u8 i = 0; i < 0xA0; i++) wram[i] = i + 1;
+    write(0xFF46, 0xC0);
+    test_run_dots(36);
+    ASSERT(read(0xC000) == 11);
+    switch_speed();
+    ASSERT(read(0xC000) == 11);
+    test_run_dots(2);
+    ASSERT(read(0xC000) == 12);
+    test_run_dots(149 * 2 - 2);
+    ASSERT(dma_transfer_flag);
+    test_run_dots(2);
+    ASSERT(!dma_transfer_flag);
+}
+TEST("oam reads return ff during an oam dma") {
+    oam_dma_test_start();
+    ASSERT(read(0xFE00) == 0xFF && read(0xFE9F) == 0xFF);
+}
+TEST("reads on the bus an oam dma uses return the byte being copied") {
+    oam_dma_test_start();
+    ASSERT(read(0xC000) == 2);
+    ASSERT(read(0xA123) == 2);
+    test_run_dots(8);
+    ASSERT(read(0xD000) == 4);
+    ASSERT(read(0x8000) == vram[0]);
+}
+TEST("hram and i/o are not affected by an oam dma") {
+    oam_dma_test_start();
+    hram[0] = 0x5A;
+    ASSERT(read(0xFF80) == 0x5A);
+    ASSERT(read(0xFF40) == reg[REG_LCDC]);
+}
+TEST("oam writes are dropped during an oam dma") {
+    oam_dma_test_start();
+    write(0xFE00, 0x77);
+    test_run_dots(640);
+    ASSERT(oam[0] == 1);
+    write(0xFE00, 0x77);
+    ASSERT(oam[0] == 0x77);
+}
+TEST("an oam dma ends after 640 dots") {
+    oam_dma_test_start();
+    test_run_dots(640 - 8);
+    ASSERT(dma_transfer_flag);
+    ASSERT(read(0xC000) == 0xA0);
+    test_run_dots(4);
+    ASSERT(!dma_transfer_flag);
+    ASSERT(read(0xC000) == 1 && read(0xFE00) == 1 && oam[0x9F] == 0xA0);
+}
 
 #endif
\ No newline at end of file
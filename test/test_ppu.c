@@ -0,0 +1,31 @@
+#if defined HEADERS
+
+// Runs on the core from test_cpu.c. Tile 0 fills the map, each of its rows i has
+// a single pixel of color 1 in column i.
+void ppu_test_start(u8 cgb, u8 scx, u8 scy)
+{
+    test_power_up_model(cgb);
+    memset(vram, 0, sizeof(vram));
+    for (u8 i = 0; i < 8; i++) vram[i * 2] = 0x80 >> i;
+    reg[REG_LCDC] = 0x91;
+    reg[REG_SCX] = scx;
+    reg[REG_SCY] = scy;
+}
+
+#elif defined TESTS
+
+TEST("the dmg background follows the fine scroll") {
+    // Row 2 of the tile on line 0, its pixel lands where (x + 3) & 7 == 2
+    ppu_test_start(0, 3, 2);
+    draw_tiles(0);
+    ASSERT(line_index[7] == 1 && line_index[15] == 1);
+    ASSERT(line_index[6] == 0 && line_index[8] == 0 && line_index[2] == 0);
+}
+TEST("the cgb background follows the same fine scroll") {
+    ppu_test_start(1, 3, 2);
+    draw_tiles_cgb(0);
+    ASSERT(line_index[7] == 1 && line_index[15] == 1);
+    ASSERT(line_index[6] == 0 && line_index[8] == 0 && line_index[2] == 0);
+}
+
+#endif
\ No newline at end of file
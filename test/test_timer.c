@@ -0,0 +1,107 @@
+#if defined HEADERS
+
+// Runs on the core from test_cpu.c. Every write takes one M-cycle (4 dots), so the
+// system counter is at 8 when this returns, with TAC written at 4.
+void timer_test_start(u8 tac)
+{
+    test_power_up();
+    write(0xFF00 | REG_TAC, 0x00);
+    write(0xFF00 | REG_TIMA, 0);
+    write(0xFF00 | REG_DIV, 0);
+    write(0xFF00 | REG_TAC, tac);
+    reg[REG_IF] = 0;
+}
+
+#elif defined TESTS
+
+TEST("div counts every 256 dots") {
+    timer_test_start(0x00);
+    test_run_dots(244);
+    ASSERT(read(0xFF04) == 0x00);
+    test_run_dots(4);
+    ASSERT(read(0xFF04) == 0x01);
+    test_run_dots(256 * 254);
+    ASSERT(read(0xFF04) == 0xFF);
+    test_run_dots(256);
+    ASSERT(read(0xFF04) == 0x00);
+}
+TEST("tima counts at the rate selected in tac") {
+    const u32 periods[4] = { 1024, 16, 64, 256 };
+    for (u8 i = 0; i < 4; i++) {
+        timer_test_start(0x04 | i);
+        test_run_dots(periods[i] * 3 - 12);
+        ASSERT(read(0xFF05) == 2);
+        test_run_dots(4);
+        ASSERT(read(0xFF05) == 3);
+    }
+}
+TEST("tima reloads from tma and requests an interrupt on overflow") {
+    timer_test_start(0x05);
+    write(0xFF06, 0xF0);
+    write(0xFF05, 0xFE);
+    ASSERT(read(0xFF05) == 0xFF);
+    ASSERT(!GET_BIT(reg[REG_IF], INT_BIT_TIMER));
+    test_run_dots(16);
+    ASSERT(read(0xFF05) == 0xF0);
+    ASSERT(GET_BIT(reg[REG_IF], INT_BIT_TIMER));
+    reg[REG_IF] = 0;
+    test_run_dots(16 * 15);
+    ASSERT(read(0xFF05) == 0xFF);
+    test_run_dots(16);
+    ASSERT(read(0xFF05) == 0xF0);
+    ASSERT(GET_BIT(reg[REG_IF], INT_BIT_TIMER));
+}
+TEST("a stopped timer keeps tima") {
+    timer_test_start(0x05);
+    test_run_dots(24);
+    write(0xFF07, 0x01);
+    test_run_dots(1024);
+    ASSERT(read(0xFF05) == 2);
+}
+TEST("writing div is a tima edge while the selected bit is set") {
+    timer_test_start(0x05);
+    write(0xFF04, 0);
+    ASSERT(read(0xFF05) == 1);
+    write(0xFF04, 0);
+    ASSERT(read(0xFF05) == 1);
+    test_run_dots(12);
+    ASSERT(read(0xFF05) == 2);
+}
+TEST("disabling the timer or selecting a cleared bit is a tima edge") {
+    timer_test_start(0x05);
+    write(0xFF07, 0x01);
+    ASSERT(read(0xFF05) == 1);
+    // Enabling is not an edge, only the regular one at 16 counts
+    write(0xFF07, 0x05);
+    ASSERT(read(0xFF05) == 2);
+    test_run_dots(8);
+    write(0xFF07, 0x04);
+    ASSERT(read(0xFF05) == 3);
+}
+TEST("double speed doubles the rate of div and tima") {
+    timer_test_start(0x05);
+    switch_speed();
+    write(0xFF04, 0);
+    write(0xFF05, 0);
+    test_run_dots(122);
+    ASSERT(read(0xFF04) == 0x00);
+    test_run_dots(2);
+    ASSERT(read(0xFF04) == 0x01);
+    ASSERT(read(0xFF05) == 16);
+}
+TEST("a speed switch resets div, a tima edge while the selected bit is set") {
+    timer_test_start(0x05);
+    test_run_dots(256 * 3);
+    ASSERT(read(0xFF05) == 48);
+    switch_speed();
+    ASSERT(read(0xFF04) == 0x00);
+    ASSERT(read(0xFF05) == 49);
+    test_run_dots(124);
+    ASSERT(read(0xFF04) == 0x00);
+    ASSERT(read(0xFF05) == 64);
+    test_run_dots(4);
+    ASSERT(read(0xFF04) == 0x01);
+    ASSERT(read(0xFF05) == 65);
+}
+
+#endif
\ No newline at end of file
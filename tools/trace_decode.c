@@ -0,0 +1,67 @@
+// Decodes a binary instruction trace (see trace.h) into gameboy-doctor lines:
+// A:00 F:00 B:00 C:00 D:00 E:00 H:00 L:00 SP:0000 PC:0000 PCMEM:00,00,00,00
+//
+// Usage: trace_decode trace.bin [--extended] > trace.txt
+//   --extended    appends the ROM bank and master clock to every line
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define BATCH_RECORDS 4096
+
+int main(int argc, char* argv[])
+{
+    const char*     path = NULL;
+    u8              extended = 0;
+    FILE*           fp;
+    TraceHeader     header;
+    TraceRecord     records[BATCH_RECORDS];
+    u64             left;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--extended") == 0) extended = 1;
+        else path = argv[i];
+    }
+    if (path == NULL) {
+        fprintf(stderr, "Usage: trace_decode trace.bin [--extended]\n");
+        return -1;
+    }
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, "ATRC", 4) != 0) {
+        fprintf(stderr, "Not a trace file: %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "Unsupported trace version %u (record size %u)\n", header.version, header.record_size);
+        fclose(fp);
+        return -1;
+    }
+
+    for (left = header.count; left > 0;) {
+        size_t batch = left < BATCH_RECORDS ? (size_t)left : BATCH_RECORDS;
+        if (fread(records, sizeof(TraceRecord), batch, fp) != batch) {
+            fprintf(stderr, "Trace ended early, %llu records missing\n", left);
+            fclose(fp);
+            return -1;
+        }
+        for (size_t i = 0; i < batch; i++) {
+            const TraceRecord* r = &records[i];
+            printf("A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X",
+                r->af >> 8, r->af & 0xFF, r->bc >> 8, r->bc & 0xFF, r->de >> 8, r->de & 0xFF, r->hl >> 8, r->hl & 0xFF,
+                r->sp, r->pc, r->bytes[0], r->bytes[1], r->bytes[2], r->bytes[3]);
+            if (extended) printf(" BANK:%02X CY:%llu", r->bank, r->cycle);
+            printf("\n");
+        }
+        left -= batch;
+    }
+
+    fclose(fp);
+    return 0;
+}